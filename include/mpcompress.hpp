@@ -0,0 +1,360 @@
+#pragma once
+
+#include "mppacker.hpp"
+#include <algorithm>
+
+namespace mpcompact {
+
+namespace detail {
+
+/******************************************************
+ * Block compression
+ *
+ * Frame:  MP_FRAME, uint64 raw size, blocks
+ * Block:  uint32 header, payload
+ *
+ * Every block but the last holds BLOCK_SIZE raw bytes.
+ * The header is the payload length, with BLOCK_STORED
+ * set when the payload is the raw bytes because they
+ * did not compress.
+ *
+ * Payloads are LZ77 sequences: a token byte with the
+ * literal count in the high and match length - 4 in the
+ * low nibble (15 continues in following bytes, each 255
+ * adds and stops at the first smaller one), the literals,
+ * then a uint16 match offset. The last sequence of a
+ * block has literals only.
+ ******************************************************/
+
+static const uint8_t  MP_FRAME      = 0xc1; //!< Never used by MessagePack
+static const size_t   FRAME_HEADER  = 1 + sizeof(uint64_t);
+static const size_t   BLOCK_SIZE    = 1 << 16;
+static const uint32_t BLOCK_STORED  = 0x80000000;
+
+static const size_t   LZ_MIN_MATCH  = 4;
+static const size_t   LZ_MAX_OFFSET = MAX_16BIT;
+static const size_t   LZ_HASH_BITS  = 13;
+static const size_t   LZ_MAX_EXPANSION = 255;  //!< Raw bytes per payload byte at most, a length byte adds 255
+
+//! Worst case payload size of a block, before falling back to stored
+constexpr size_t lz_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+inline uint32_t lz_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+inline uint8_t* lz_write_length(uint8_t* op, size_t length)
+{
+    for(; length >= 255; length -= 255)
+        *op++ = 255;
+
+    *op++ = static_cast<uint8_t>(length);
+    return op;
+}
+
+inline uint8_t* lz_write_sequence(uint8_t* op, const uint8_t* literals, size_t literalLength,
+                                  size_t offset, size_t matchLength)
+{
+    uint8_t* token = op++;
+    size_t   match = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+
+    *token = static_cast<uint8_t>((literalLength < 15 ? literalLength : 15) << 4);
+    if(literalLength >= 15)
+        op = lz_write_length(op, literalLength - 15);
+
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if(matchLength == 0)
+        return op;
+
+    uint16_t off = static_cast<uint16_t>(offset);
+    memcpy(op, &off, sizeof(off));
+    op += sizeof(off);
+
+    *token |= static_cast<uint8_t>(match < 15 ? match : 15);
+    if(match >= 15)
+        op = lz_write_length(op, match - 15);
+
+    return op;
+}
+
+//! Compresses n bytes into dst, which must hold lz_bound(n), returns the payload size
+inline size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, uint32_t* table)
+{
+    memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+
+    const uint8_t* ip     = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end    = src + n;
+    uint8_t*       op     = dst;
+
+    while(end - ip >= static_cast<ptrdiff_t>(LZ_MIN_MATCH))
+    {
+        uint32_t  seq = lz_read32(ip);
+        uint32_t& entry = table[lz_hash(seq)];
+        const uint8_t* candidate = src + entry;
+        entry = static_cast<uint32_t>(ip - src);
+
+        if(candidate >= ip || static_cast<size_t>(ip - candidate) > LZ_MAX_OFFSET ||
+           lz_read32(candidate) != seq)
+        {
+            // step faster through data that does not match
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while(ip + length < end && candidate[length] == ip[length])
+            length++;
+
+        op = lz_write_sequence(op, anchor, ip - anchor, ip - candidate, length);
+        ip += length;
+        anchor = ip;
+    }
+
+    return lz_write_sequence(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+inline bool lz_read_length(const uint8_t*& ip, const uint8_t* end, size_t& length)
+{
+    uint8_t b;
+    do {
+        if(ip == end)
+            return false;
+
+        b = *ip++;
+        length += b;
+    } while(b == 255);
+
+    return true;
+}
+
+//! Decompresses a payload into exactly n bytes at dst, false if it is malformed
+inline bool lz_decompress(const uint8_t* src, size_t length, uint8_t* dst, size_t n)
+{
+    const uint8_t* ip    = src;
+    const uint8_t* inEnd = src + length;
+    uint8_t*       op    = dst;
+    uint8_t*       end   = dst + n;
+
+    while(ip < inEnd)
+    {
+        uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if(literals == 15 && !lz_read_length(ip, inEnd, literals))
+            return false;
+
+        if(static_cast<size_t>(inEnd - ip) < literals || static_cast<size_t>(end - op) < literals)
+            return false;
+
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        if(ip == inEnd)
+            break;
+
+        uint16_t offset;
+        if(inEnd - ip < static_cast<ptrdiff_t>(sizeof(offset)))
+            return false;
+
+        memcpy(&offset, ip, sizeof(offset));
+        ip += sizeof(offset);
+
+        size_t match = token & 0x0f;
+        if(match == 15 && !lz_read_length(ip, inEnd, match))
+            return false;
+
+        match += LZ_MIN_MATCH;
+        if(offset == 0 || offset > op - dst || static_cast<size_t>(end - op) < match)
+            return false;
+
+        const uint8_t* from = op - offset;
+        if(offset >= match)
+        {
+            memcpy(op, from, match);
+            op += match;
+        }
+        else
+        {
+            // overlapping copy repeats the last offset bytes
+            for(size_t i=0; i<match; i++)
+                *op++ = from[i];
+        }
+    }
+
+    return op == end;
+}
+
+} // end namespace detail
+
+
+/*****************************************************
+ * Compressor wraps packed output in a frame when it
+ * is at least threshold bytes. Smaller input is passed
+ * through untouched, data() then points at the input.
+ *
+ * Blocks are compressed in one pass once the message
+ * is packed, not as the Packer fills them: reserve()
+ * spans are written after later bytes. The frame is a
+ * second buffer of up to input + input / 255 + 20
+ * bytes per block, kept for reuse by the next call.
+ *****************************************************/
+
+class Compressor
+{
+    std::vector<char>       frame;
+    std::vector<uint32_t>   table;
+    const char*             ptr;
+    size_t                  length;
+    size_t                  threshold;
+
+public:
+    explicit Compressor(size_t t = 1024)
+        : frame(), table(size_t(1) << detail::LZ_HASH_BITS), ptr(NULL), length(0), threshold(t) {}
+
+    const char* data() const { return ptr;      }
+    size_t      size() const { return length;   }
+
+    Compressor& compress(const Packer& packer) { return compress(packer.data(), packer.size()); }
+
+    Compressor& compress(const char* data, size_t size)
+    {
+        if(size < threshold)
+        {
+            ptr = data;
+            length = size;
+            return *this;
+        }
+
+        size_t blocks = (size + detail::BLOCK_SIZE - 1) / detail::BLOCK_SIZE;
+        frame.resize(detail::FRAME_HEADER + blocks * (sizeof(uint32_t) + detail::lz_bound(detail::BLOCK_SIZE)));
+
+        char*    op  = frame.data();
+        uint64_t raw = size;
+        *op++ = detail::MP_FRAME;
+        memcpy(op, &raw, sizeof(raw));
+        op += sizeof(raw);
+
+        const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+        for(size_t offset=0; offset<size; offset+=detail::BLOCK_SIZE)
+        {
+            size_t   n = std::min(detail::BLOCK_SIZE, size - offset);
+            uint8_t* payload = reinterpret_cast<uint8_t*>(op + sizeof(uint32_t));
+
+            uint32_t header = detail::lz_compress(src + offset, n, payload, table.data());
+            if(header >= n)
+            {
+                memcpy(payload, src + offset, n);
+                header = n | detail::BLOCK_STORED;
+            }
+
+            memcpy(op, &header, sizeof(header));
+            op += sizeof(header) + (header & ~detail::BLOCK_STORED);
+        }
+
+        ptr = frame.data();
+        length = op - frame.data();
+        return *this;
+    }
+};
+
+
+/*****************************************************
+ * Decompressor gives an Unpacker over framed or plain
+ * input. Frames are expanded into a buffer reused by
+ * the next call, plain input is read in place.
+ *
+ * The whole frame is expanded before unpacking starts,
+ * since unpack_view() points into the input, so the
+ * buffer holds the full raw size next to the frame.
+ *****************************************************/
+
+class Decompressor
+{
+    std::vector<char> buffer;
+
+public:
+    Decompressor() : buffer() {}
+
+    static bool is_frame(const char* data, size_t size)
+    {
+        return size > 0 && static_cast<uint8_t>(*data) == detail::MP_FRAME;
+    }
+
+    Unpacker decompress(const char* data, size_t size)
+    {
+        if(!is_frame(data, size))
+            return Unpacker(data, size);
+
+        if(size < detail::FRAME_HEADER)
+            detail::fail<std::runtime_error>("Invalid compressed frame");
+
+        uint64_t raw;
+        memcpy(&raw, data + 1, sizeof(raw));
+
+        // rounding up to whole blocks must not wrap, each block needs at least its header
+        const char* ip  = data + detail::FRAME_HEADER;
+        const char* end = data + size;
+        if(raw > SIZE_MAX - detail::BLOCK_SIZE ||
+           (raw + detail::BLOCK_SIZE - 1) / detail::BLOCK_SIZE > static_cast<size_t>(end - ip) / sizeof(uint32_t))
+            detail::fail<std::runtime_error>("Invalid compressed frame");
+
+        // the output grows with the blocks present, not with the size the frame claims
+        buffer.reserve(std::min<uint64_t>(raw, detail::LZ_MAX_EXPANSION * size));
+
+        for(uint64_t offset=0; offset<raw; offset+=detail::BLOCK_SIZE)
+        {
+            size_t n = std::min<uint64_t>(detail::BLOCK_SIZE, raw - offset);
+
+            uint32_t header;
+            if(end - ip < static_cast<ptrdiff_t>(sizeof(header)))
+                detail::fail<std::runtime_error>("Invalid compressed frame");
+
+            memcpy(&header, ip, sizeof(header));
+            ip += sizeof(header);
+
+            size_t length = header & ~detail::BLOCK_STORED;
+            if(static_cast<size_t>(end - ip) < length)
+                detail::fail<std::runtime_error>("Invalid compressed frame");
+
+            if(buffer.size() < offset + n)
+                buffer.resize(offset + n);
+
+            uint8_t* dst = reinterpret_cast<uint8_t*>(buffer.data());
+
+            const uint8_t* payload = reinterpret_cast<const uint8_t*>(ip);
+            if(header & detail::BLOCK_STORED)
+            {
+                if(length != n)
+                    detail::fail<std::runtime_error>("Invalid compressed frame");
+
+                memcpy(dst + offset, payload, n);
+            }
+            else if(!detail::lz_decompress(payload, length, dst + offset, n))
+            {
+                detail::fail<std::runtime_error>("Invalid compressed frame");
+            }
+
+            ip += length;
+        }
+
+        buffer.resize(raw);
+        return Unpacker(buffer.data(), buffer.size());
+    }
+};
+
+} // end namespace mpcompact
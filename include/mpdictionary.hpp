@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace mpcompact {
+
+/******************************************************
+ * String dictionary shared by a Packer and the Unpacker
+ * reading its output. Entries get consecutive ids and
+ * are never moved, so decoded strings can point into
+ * the dictionary. Both sides must start from the same
+ * entries, either added up front (negotiated) or empty
+ * and grown in stream order (incremental).
+ ******************************************************/
+
+class StringDictionary
+{
+    std::deque<std::string> entries;
+    std::vector<uint32_t>   slots;      //!< Open addressing, id + 1 or 0 when empty
+    size_t                  maxEntries;
+    size_t                  minLength;
+
+    static uint64_t hash(const char* data, size_t length)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for(size_t i=0; i<length; i++) {
+            h ^= static_cast<uint8_t>(data[i]);
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    void insert_slot(uint32_t id)
+    {
+        const std::string& s = entries[id];
+        size_t mask = slots.size() - 1;
+        size_t i = hash(s.data(), s.size()) & mask;
+        while(slots[i])
+            i = (i + 1) & mask;
+
+        slots[i] = id + 1;
+    }
+
+public:
+    //! Holds at most m entries, strings shorter than l are not interned
+    StringDictionary(size_t m = 4096, size_t l = 4)
+        : entries(), slots(64), maxEntries(m), minLength(l) {}
+
+    size_t size() const                     { return entries.size();            }
+    bool   full() const                     { return entries.size() >= maxEntries; }
+    size_t min_length() const               { return minLength;                 }
+    const std::string& at(uint32_t id) const { return entries.at(id);           }
+
+    bool find(const char* data, size_t length, uint32_t& id) const
+    {
+        size_t mask = slots.size() - 1;
+        for(size_t i = hash(data, length) & mask; slots[i]; i = (i + 1) & mask)
+        {
+            const std::string& s = entries[slots[i] - 1];
+            if(s.size() == length && memcmp(s.data(), data, length) == 0) {
+                id = slots[i] - 1;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    //! Appends an entry and returns its id, the caller checks full() and find() first
+    uint32_t add(const char* data, size_t length)
+    {
+        uint32_t id = entries.size();
+        entries.emplace_back(data, length);
+
+        if(entries.size() * 2 > slots.size())
+        {
+            slots.assign(slots.size() * 2, 0);
+            for(uint32_t i=0; i<entries.size(); i++)
+                insert_slot(i);
+        }
+        else
+        {
+            insert_slot(id);
+        }
+
+        return id;
+    }
+
+    uint32_t add(const std::string& s) { return add(s.data(), s.size()); }
+
+    //! Drops the entries from id size on, strings of a message that was never sent
+    void truncate(size_t size)
+    {
+        if(size >= entries.size())
+            return;
+
+        entries.resize(size);
+        slots.assign(slots.size(), 0);
+        for(uint32_t i=0; i<entries.size(); i++)
+            insert_slot(i);
+    }
+
+    void clear()
+    {
+        entries.clear();
+        slots.assign(64, 0);
+    }
+};
+
+} // end namespace mpcompact
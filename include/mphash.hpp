@@ -0,0 +1,209 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+namespace mpcompact {
+
+//! Two 64 bit hashes of the same bytes, see Packer::hash128()
+struct Hash128
+{
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const Hash128& o) const { return low == o.low && high == o.high; }
+    bool operator!=(const Hash128& o) const { return !(*this == o);                  }
+};
+
+namespace detail {
+
+/******************************************************
+ * Streaming XXH64
+ *
+ * Produces the same digests as the reference XXH64 of
+ * the concatenated input (on little endian hosts),
+ * however it is split between update() calls. Input
+ * is consumed in 32 byte stripes by four accumulators,
+ * shorter pieces wait in buffer.
+ ******************************************************/
+
+class Xxh64
+{
+    static const uint64_t P1 = 11400714785074694791ull;
+    static const uint64_t P2 = 14029467366897019727ull;
+    static const uint64_t P3 =  1609587929392839161ull;
+    static const uint64_t P4 =  9650029242287828579ull;
+    static const uint64_t P5 =  2870177450012600261ull;
+
+    uint64_t seed;
+    uint64_t acc[4];
+    uint64_t total;
+    uint8_t  buffer[32];
+    size_t   buffered;
+
+    static uint64_t rotl(uint64_t x, int r)    { return (x << r) | (x >> (64 - r)); }
+
+    static uint64_t read64(const uint8_t* p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint32_t read32(const uint8_t* p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input)
+    {
+        acc += input * P2;
+        acc  = rotl(acc, 31);
+        return acc * P1;
+    }
+
+    static uint64_t merge(uint64_t h, uint64_t acc)
+    {
+        h ^= round(0, acc);
+        return h * P1 + P4;
+    }
+
+    void stripe(const uint8_t* p)
+    {
+        acc[0] = round(acc[0], read64(p));
+        acc[1] = round(acc[1], read64(p + 8));
+        acc[2] = round(acc[2], read64(p + 16));
+        acc[3] = round(acc[3], read64(p + 24));
+    }
+
+public:
+    explicit Xxh64(uint64_t s = 0) { reset(s); }
+
+    void reset(uint64_t s)
+    {
+        seed   = s;
+        acc[0] = s + P1 + P2;
+        acc[1] = s + P2;
+        acc[2] = s;
+        acc[3] = s - P1;
+        total  = 0;
+        buffered = 0;
+    }
+
+    void reset() { reset(seed); }
+
+    void update(const void* data, size_t length)
+    {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        total += length;
+
+        if(buffered + length < sizeof(buffer))
+        {
+            memcpy(buffer + buffered, p, length);
+            buffered += length;
+            return;
+        }
+
+        if(buffered)
+        {
+            size_t fill = sizeof(buffer) - buffered;
+            memcpy(buffer + buffered, p, fill);
+            stripe(buffer);
+            p += fill;
+            length -= fill;
+            buffered = 0;
+        }
+
+        for(; length >= sizeof(buffer); p += sizeof(buffer), length -= sizeof(buffer))
+            stripe(p);
+
+        memcpy(buffer, p, length);
+        buffered = length;
+    }
+
+    uint64_t digest() const
+    {
+        uint64_t h;
+        if(total >= sizeof(buffer))
+        {
+            h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+            h = merge(h, acc[0]);
+            h = merge(h, acc[1]);
+            h = merge(h, acc[2]);
+            h = merge(h, acc[3]);
+        }
+        else
+        {
+            h = seed + P5;
+        }
+
+        h += total;
+
+        const uint8_t* p   = buffer;
+        const uint8_t* end = buffer + buffered;
+        for(; end - p >= 8; p += 8) {
+            h ^= round(0, read64(p));
+            h  = rotl(h, 27) * P1 + P4;
+        }
+
+        if(end - p >= 4) {
+            h ^= read32(p) * P1;
+            h  = rotl(h, 23) * P2 + P3;
+            p += 4;
+        }
+
+        for(; p < end; p++) {
+            h ^= *p * P5;
+            h  = rotl(h, 11) * P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+
+//! Output hash of a Packer, allocated only while hashing is enabled
+class OutputHash
+{
+    static const uint64_t SEED_HIGH = 0x9e3779b97f4a7c15ull;
+
+    Xxh64   low;
+    Xxh64   high;
+    bool    wide;
+
+public:
+    explicit OutputHash(bool w) : low(0), high(SEED_HIGH), wide(w) {}
+
+    bool is_wide() const { return wide; }
+
+    void update(const void* data, size_t length)
+    {
+        low.update(data, length);
+        if(wide)
+            high.update(data, length);
+    }
+
+    void reset()
+    {
+        low.reset();
+        high.reset();
+    }
+
+    uint64_t digest64() const   { return low.digest(); }
+    Hash128  digest128() const
+    {
+        Hash128 h = { low.digest(), high.digest() };
+        return h;
+    }
+};
+
+} // end namespace detail
+
+} // end namespace mpcompact
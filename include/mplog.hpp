@@ -0,0 +1,332 @@
+#pragma once
+
+#include "mppacker.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mpcompact {
+
+namespace detail {
+
+//! Bytes of fd taken by complete records, a torn one left by a crash ends them
+inline uint64_t log_complete_length(int fd, uint64_t size)
+{
+    if(size == 0)
+        return 0;
+
+    void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED)
+        throw std::runtime_error(std::string("Cannot map log: ") + strerror(errno));
+
+    const char* base = static_cast<const char*>(p);
+    uint64_t offset = 0;
+    uint32_t header;
+    while(size - offset >= sizeof(header))
+    {
+        memcpy(&header, base + offset, sizeof(header));
+        if(size - offset - sizeof(header) < header)
+            break;
+
+        offset += sizeof(header) + header;
+    }
+
+    munmap(p, size);
+    return offset;
+}
+
+} // end namespace detail
+
+
+/******************************************************
+ * Append-only message log
+ *
+ * Records are a uint32 length followed by the packed
+ * message. Producers copy records into a shared buffer;
+ * a flusher thread swaps it with a second buffer and
+ * writes the batch with one pwrite and one fdatasync
+ * once syncBytes are pending or syncMicros have passed,
+ * whichever comes first (group commit). Opening a log
+ * cuts off a torn record a crash left at its end.
+ ******************************************************/
+
+class LogWriter
+{
+    LogWriter(const LogWriter&) = delete;
+    void operator=(const LogWriter&) = delete;
+
+    int                     fd;
+    uint64_t                fileOffset;
+
+    std::vector<char>       buffers[2];
+    int                     active;
+    size_t                  used;
+
+    const size_t            flushSize;
+    const std::chrono::microseconds flushDelay;
+
+    uint64_t                appended;   //!< Log position after the last appended record
+    uint64_t                durable;    //!< Log position synced to disk
+    std::string             error;
+    bool                    flushNow;
+    bool                    stop;
+
+    std::mutex              mutex;
+    std::condition_variable flushCv;
+    std::condition_variable doneCv;
+    std::thread             flusher;
+
+    void write_all(const char* data, size_t length)
+    {
+        while(length)
+        {
+            ssize_t n = pwrite(fd, data, length, fileOffset);
+            if(n < 0 && errno == EINTR)
+                continue;
+
+            if(n <= 0)
+                throw std::runtime_error(std::string("Log write failed: ") + strerror(errno));
+
+            data += n;
+            length -= n;
+            fileOffset += n;
+        }
+
+        if(fdatasync(fd) != 0)
+            throw std::runtime_error(std::string("Log sync failed: ") + strerror(errno));
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;)
+        {
+            flushCv.wait_for(lock, flushDelay, [this] { return stop || flushNow || used >= flushSize; });
+            flushNow = false;
+
+            if(used == 0)
+            {
+                if(stop)
+                    return;
+
+                continue;
+            }
+
+            std::vector<char>& batch = buffers[active];
+            size_t   length = used;
+            uint64_t target = appended;
+            active ^= 1;
+            used = 0;
+            doneCv.notify_all();
+
+            lock.unlock();
+            try {
+                write_all(batch.data(), length);
+            } catch(std::exception& e) {
+                lock.lock();
+                error = e.what();
+                doneCv.notify_all();
+                return;
+            }
+            lock.lock();
+
+            durable = target;
+            doneCv.notify_all();
+        }
+    }
+
+    void check_error()
+    {
+        if(!error.empty())
+            throw std::runtime_error(error);
+    }
+
+public:
+    LogWriter(const std::string& path, size_t bufferSize = 1 << 20,
+              size_t syncBytes = 256 << 10, unsigned syncMicros = 1000)
+        : fd(-1), fileOffset(0), active(0), used(0), flushSize(syncBytes), flushDelay(syncMicros),
+          appended(0), durable(0), error(), flushNow(false), stop(false)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(fd < 0)
+            throw std::runtime_error(std::string("Cannot open log: ") + strerror(errno));
+
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error(std::string("Cannot open log: ") + strerror(err));
+        }
+
+        // cut a torn record off, appending after it would hide every later one
+        try {
+            fileOffset = detail::log_complete_length(fd, st.st_size);
+            if(fileOffset != static_cast<uint64_t>(st.st_size) &&
+               (ftruncate(fd, fileOffset) != 0 || fdatasync(fd) != 0))
+                throw std::runtime_error(std::string("Cannot truncate log: ") + strerror(errno));
+        } catch(...) {
+            close(fd);
+            throw;
+        }
+
+        appended = durable = fileOffset;
+
+        buffers[0].resize(bufferSize);
+        buffers[1].resize(bufferSize);
+
+        flusher = std::thread(&LogWriter::run, this);
+    }
+
+    //! Flushes pending records
+    ~LogWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        flushCv.notify_one();
+        flusher.join();
+        close(fd);
+    }
+
+    //! Queues a record and returns its end position for wait()
+    uint64_t append(const char* data, size_t size)
+    {
+        const size_t length = sizeof(uint32_t) + size;
+        if(size > detail::MAX_32BIT || length > buffers[0].size())
+            throw std::runtime_error("Log record exceeds buffer size");
+
+        std::unique_lock<std::mutex> lock(mutex);
+        check_error();
+
+        // backpressure while the flusher still writes the other buffer
+        while(used + length > buffers[active].size()) {
+            flushNow = true;
+            flushCv.notify_one();
+            doneCv.wait(lock);
+            check_error();
+        }
+
+        char* ptr = buffers[active].data() + used;
+        uint32_t header = size;
+        memcpy(ptr, &header, sizeof(header));
+        memcpy(ptr + sizeof(header), data, size);
+
+        used += length;
+        appended += length;
+        if(used >= flushSize)
+            flushCv.notify_one();
+
+        return appended;
+    }
+
+    uint64_t append(const Packer& packer) { return append(packer.data(), packer.size()); }
+
+    //! Blocks until the log is durable up to position
+    void wait(uint64_t position)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(durable < position) {
+            check_error();
+            doneCv.wait(lock);
+        }
+    }
+
+    //! Blocks until everything appended so far is durable
+    void sync()
+    {
+        uint64_t position;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            position = appended;
+            flushNow = true;
+        }
+        flushCv.notify_one();
+        wait(position);
+    }
+};
+
+
+/******************************************************
+ * Reads the records of a log in place. A torn record
+ * at the end of the file ends the log.
+ ******************************************************/
+
+class LogReader
+{
+    LogReader(const LogReader&) = delete;
+    void operator=(const LogReader&) = delete;
+
+    const char* base;
+    size_t      length;
+    size_t      offset;
+
+public:
+    explicit LogReader(const std::string& path) : base(NULL), length(0), offset(0)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            throw std::runtime_error(std::string("Cannot open log: ") + strerror(errno));
+
+        struct stat st;
+        void* p = NULL;
+        if(fstat(fd, &st) != 0 ||
+           (st.st_size > 0 && (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+        {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error(std::string("Cannot map log: ") + strerror(err));
+        }
+
+        close(fd);
+        base = static_cast<const char*>(p);
+        length = p ? st.st_size : 0;
+    }
+
+    ~LogReader()
+    {
+        if(base)
+            munmap(const_cast<char*>(base), length);
+    }
+
+    //! Next record in place, false at the end of the log
+    bool next(const char*& data, size_t& size)
+    {
+        uint32_t header;
+        if(length - offset < sizeof(header))
+            return false;
+
+        memcpy(&header, base + offset, sizeof(header));
+        if(length - offset - sizeof(header) < header)
+            return false;
+
+        data = base + offset + sizeof(header);
+        size = header;
+        offset += sizeof(header) + header;
+
+        return true;
+    }
+
+    template<typename T>
+    bool next(T& ref)
+    {
+        const char* data;
+        size_t size;
+        if(!next(data, size))
+            return false;
+
+        Unpacker unpacker(data, size);
+        unpacker.unpack(ref);
+        return true;
+    }
+};
+
+} // end namespace mpcompact
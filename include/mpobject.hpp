@@ -21,6 +21,20 @@ protected:
     Object*             parentObj;
     std::vector<Field>  fieldVec;
 
+    //! Leaf fields in pack order, parent fields first and nested objects expanded
+    void flatten(std::vector<const Field*>& out) const
+    {
+        if(parentObj)
+            parentObj->flatten(out);
+
+        for(auto& field : fieldVec) {
+            if(field.nestedObject == NULL)
+                out.push_back(&field);
+            else
+                field.nestedObject->flatten(out);
+        }
+    }
+
 public:
     Object() : parentObj(NULL), fieldVec() {}
     virtual ~Object() {}
@@ -57,6 +71,11 @@ public:
 
     const Object& pack(Packer& packer) const
     {
+#ifdef MPCOMPACT_STATS
+        stats::Timer timer;
+        size_t start = packer.size();
+#endif
+
         if(parentObj)
             parentObj->pack(packer);
 
@@ -67,11 +86,20 @@ public:
                 field.nestedObject->pack(packer);
         }
 
+#ifdef MPCOMPACT_STATS
+        stats::record_pack(typeid(*this).name(), packer.size() - start, timer.elapsed());
+#endif
+
         return *this;
     }
 
     const Object& unpack(Unpacker& unpacker) const
     {
+#ifdef MPCOMPACT_STATS
+        stats::Timer timer;
+        size_t start = unpacker.size();
+#endif
+
         if(parentObj)
             parentObj->unpack(unpacker);
 
@@ -82,8 +110,124 @@ public:
                 field.nestedObject->unpack(unpacker);
         }
 
+#ifdef MPCOMPACT_STATS
+        stats::record_unpack(typeid(*this).name(), start - unpacker.size(), timer.elapsed());
+#endif
+
         return *this;
     }
+
+
+    /*
+     * Records: the fields wrapped in an array of field_count() elements,
+     * so every object is one value that skip() and StructuralIndex can
+     * step over, e.g. as the elements of an array.
+     */
+    const Object& pack_record(Packer& packer) const
+    {
+        packer.pack_array_header(field_count());
+        return pack(packer);
+    }
+
+    const Object& unpack_record(Unpacker& unpacker) const
+    {
+        size_t fields;
+        unpacker.unpack_array_header(fields);
+        if(fields != field_count())
+            detail::fail<std::runtime_error>("Field count mismatch");
+
+        return unpack(unpacker);
+    }
+
+
+    /*
+     * Columnar batches: a batch of same type objects is packed as an array
+     * with one array per field, holding that field of every object in batch
+     * order. A column decodes like any array, e.g. straight into a
+     * std::vector<double>, after seek_column().
+     */
+    template<typename T>
+    static void pack_columns(Packer& packer, const std::vector<T>& batch)
+    {
+        std::vector<std::vector<const Field*>> rows(batch.size());
+        for(size_t i=0; i<batch.size(); i++)
+            static_cast<const Object&>(batch[i]).flatten(rows[i]);
+
+        size_t columns = rows.empty() ? T().field_count() : rows[0].size();
+        for(auto& row : rows) {
+            if(row.size() != columns)
+                detail::fail<std::runtime_error>("Column count mismatch");
+        }
+
+        packer.pack_array_header(columns);
+
+        for(size_t c=0; c<columns; c++) {
+            packer.pack_array_header(batch.size());
+            for(auto& row : rows)
+                row[c]->f_pack(packer);
+        }
+    }
+
+    //! Resizes batch to the decoded row count, T must be default constructible
+    template<typename T>
+    static void unpack_columns(Unpacker& unpacker, std::vector<T>& batch)
+    {
+        size_t columns;
+        unpacker.unpack_array_header(columns);
+
+        std::vector<std::vector<const Field*>> rows;
+        for(size_t c=0; c<columns; c++)
+        {
+            size_t size;
+            unpacker.unpack_array_header(size);
+
+            if(c == 0)
+            {
+                unpacker.charge<sizeof(T) + sizeof(std::vector<const Field*>)>(size);
+
+                // Objects are not movable, replace the batch instead of resizing it
+                if(batch.size() != size)
+                    std::vector<T>(size).swap(batch);
+
+                rows.resize(size);
+                for(size_t i=0; i<size; i++) {
+                    static_cast<const Object&>(batch[i]).flatten(rows[i]);
+                    if(rows[i].size() != columns)
+                        detail::fail<std::runtime_error>("Column count mismatch");
+
+                    unpacker.charge<sizeof(const Field*)>(columns);
+                }
+            }
+            else if(size != rows.size())
+            {
+                detail::fail<std::runtime_error>("Column size mismatch");
+            }
+
+            for(auto& row : rows)
+                row[c]->f_unpack(unpacker);
+        }
+    }
+
+    //! Positions unpacker at the array of the given column
+    static Unpacker& seek_column(Unpacker& unpacker, size_t column)
+    {
+        size_t columns;
+        unpacker.unpack_array_header(columns);
+        if(column >= columns)
+            detail::fail<std::out_of_range>("Column out of range");
+
+        for(size_t c=0; c<column; c++)
+            unpacker.skip();
+
+        return unpacker;
+    }
+
+    size_t field_count() const
+    {
+        std::vector<const Field*> fields;
+        flatten(fields);
+        return fields.size();
+    }
 };
 
 } // end namespace mpcompact
@@ -1,19 +1,51 @@
 #pragma once 
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <limits>
 #include <type_traits>
 #include <stdexcept>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 #include <map>
+#include <memory>
 #include <string.h>
 #include <typeinfo>
 
+#include "mpstats.hpp"
+#include "mputf8.hpp"
+#include "mpdictionary.hpp"
+#include "mphash.hpp"
+
+#if __cplusplus >= 201703L
+#include <optional>
+#include <variant>
+#endif
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wconversion"
 
 namespace mpcompact {
 
+//! Family of an encoded value, see Unpacker::next_type()
+enum Type
+{
+    TYPE_INVALID = 0,
+    TYPE_NIL,
+    TYPE_BOOLEAN,
+    TYPE_UINT,
+    TYPE_INT,
+    TYPE_FLOAT,
+    TYPE_STRING,
+    TYPE_BINARY,
+    TYPE_ARRAY,
+    TYPE_MAP,
+    TYPE_EXT
+};
+
 namespace detail {
 
 /******************************************************
@@ -58,6 +90,18 @@ static const uint8_t MP_BIN8  = 0xc4;
 static const uint8_t MP_BIN16 = 0xc5;
 static const uint8_t MP_BIN32 = 0xc6;
 
+//! Extension, the length is followed by a type byte
+static const uint8_t MP_EXT8     = 0xc7;
+static const uint8_t MP_EXT16    = 0xc8;
+static const uint8_t MP_EXT32    = 0xc9;
+static const uint8_t MP_FIXEXT1  = 0xd4;
+static const uint8_t MP_FIXEXT16 = 0xd8;
+
+//! Ext types used by the library
+static const int8_t MP_EXT_STRING_DEFINE = 0x60; //!< str added to the dictionary
+static const int8_t MP_EXT_STRING_REF    = 0x61; //!< Dictionary id of a str
+static const int8_t MP_EXT_TYPED_ARRAY   = 0x62; //!< Contiguous numeric elements
+
 
 /*****************************************************
  * Container types
@@ -90,31 +134,271 @@ static const uint8_t VALUE_4BIT = 0x0f;
 static const uint8_t VALUE_5BIT = 0x1f;
 static const uint8_t VALUE_7BIT = 0x7f;
 
+
+/*****************************************************
+ * Head byte dispatch table
+ *****************************************************/
+
+struct TypeInfo
+{
+    uint8_t type;   //!< Type
+    uint8_t width;  //!< Bytes of value or length following the head, 0 if inline
+    int8_t  value;  //!< Inline value or length when width is 0
+};
+
+constexpr TypeInfo type_info(uint8_t h)
+{
+    return
+        h <= MAX_7BIT      ? TypeInfo{ TYPE_UINT,    0, int8_t(h)                        } :
+        h <  MP_FIXARRAY   ? TypeInfo{ TYPE_MAP,     0, int8_t(h & VALUE_4BIT)           } :
+        h <  MP_FIXSTR     ? TypeInfo{ TYPE_ARRAY,   0, int8_t(h & VALUE_4BIT)           } :
+        h <  MP_NIL        ? TypeInfo{ TYPE_STRING,  0, int8_t(h & VALUE_5BIT)           } :
+        h == MP_NIL        ? TypeInfo{ TYPE_NIL,     0, 0                                } :
+        h <  MP_FALSE      ? TypeInfo{ TYPE_INVALID, 0, 0                                } :
+        h <= MP_TRUE       ? TypeInfo{ TYPE_BOOLEAN, 0, int8_t(h == MP_TRUE)             } :
+        h <= MP_BIN32      ? TypeInfo{ TYPE_BINARY,  uint8_t(1 << (h - MP_BIN8)),   0    } :
+        h <= MP_EXT32      ? TypeInfo{ TYPE_EXT,     uint8_t(1 << (h - MP_EXT8)),   0    } :
+        h == MP_FLOAT      ? TypeInfo{ TYPE_FLOAT,   sizeof(float),                 0    } :
+        h == MP_DOUBLE     ? TypeInfo{ TYPE_FLOAT,   sizeof(double),                0    } :
+        h <= MP_UINT64     ? TypeInfo{ TYPE_UINT,    uint8_t(1 << (h - MP_UINT8)),  0    } :
+        h <= MP_INT64      ? TypeInfo{ TYPE_INT,     uint8_t(1 << (h - MP_INT8)),   0    } :
+        h <= MP_FIXEXT16   ? TypeInfo{ TYPE_EXT,     0, int8_t(1 << (h - MP_FIXEXT1))    } :
+        h <= MP_STR32      ? TypeInfo{ TYPE_STRING,  uint8_t(1 << (h - MP_STR8)),   0    } :
+        h <= MP_ARRAY32    ? TypeInfo{ TYPE_ARRAY,   uint8_t(2 << (h - MP_ARRAY16)), 0   } :
+        h <= MP_MAP32      ? TypeInfo{ TYPE_MAP,     uint8_t(2 << (h - MP_MAP16)),  0    } :
+                             TypeInfo{ TYPE_INT,     0, int8_t(h)                        };
+}
+
+#define MP_TYPE_INFO_4(h)  type_info(h), type_info(h+1), type_info(h+2), type_info(h+3)
+#define MP_TYPE_INFO_16(h) MP_TYPE_INFO_4(h), MP_TYPE_INFO_4(h+4), MP_TYPE_INFO_4(h+8), MP_TYPE_INFO_4(h+12)
+#define MP_TYPE_INFO_64(h) MP_TYPE_INFO_16(h), MP_TYPE_INFO_16(h+16), MP_TYPE_INFO_16(h+32), MP_TYPE_INFO_16(h+48)
+
+static constexpr TypeInfo TYPE_TABLE[256] = {
+    MP_TYPE_INFO_64(0x00), MP_TYPE_INFO_64(0x40), MP_TYPE_INFO_64(0x80), MP_TYPE_INFO_64(0xc0)
+};
+
+#undef MP_TYPE_INFO_64
+#undef MP_TYPE_INFO_16
+#undef MP_TYPE_INFO_4
+
+
+//! Throws E, kept out of line so the callers' hot paths stay small
+template<typename E>
+[[noreturn]] __attribute__ (( noinline, cold )) void fail(const char* what)
+{
+#ifdef MPCOMPACT_STATS
+    stats::count_exception(what);
+#endif
+    throw E(what);
+}
+
+
+//! Encoded size of a bin or array header for n elements
+constexpr size_t bin_header_size(size_t n)
+{
+    return n <= MAX_8BIT ? 2 : n <= MAX_16BIT ? 3 : 5;
+}
+
+constexpr size_t array_header_size(size_t n)
+{
+    return n <= MAX_4BIT ? 1 : n <= MAX_16BIT ? 3 : 5;
+}
+
+//! std::index_sequence, which C++11 lacks
+template<size_t... I>
+struct index_sequence {};
+
+template<size_t N, size_t... I>
+struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...> {};
+
+template<size_t... I>
+struct make_index_sequence<0, I...> : index_sequence<I...> {};
+
+//! Encoded size of an ext8/16/32 header, including the type byte
+constexpr size_t ext_header_size(size_t n)
+{
+    return n <= MAX_8BIT ? 3 : n <= MAX_16BIT ? 4 : 6;
+}
+
+
+/*****************************************************
+ * Typed arrays
+ *
+ * Payload:  element code, flags, padding, elements
+ *
+ * The code holds the element kind in the high and its
+ * size in the low nibble. Flags hold the byte order of
+ * the writer and the number of zero bytes that align
+ * the elements to their size, relative to the start of
+ * the packed output.
+ *****************************************************/
+
+static const uint8_t TYPED_UINT         = 0x00;
+static const uint8_t TYPED_INT          = 0x10;
+static const uint8_t TYPED_FLOAT        = 0x20;
+static const uint8_t TYPED_BIG_ENDIAN   = 0x80;
+static const uint8_t TYPED_PADDING      = 0x0f;
+static const size_t  TYPED_HEADER       = 2;
+
+static const uint8_t TYPED_NATIVE_ORDER =
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? TYPED_BIG_ENDIAN : 0;
+
+template<typename T>
+constexpr uint8_t typed_code()
+{
+    return (std::is_floating_point<T>::value ? TYPED_FLOAT :
+            std::is_signed<T>::value ? TYPED_INT : TYPED_UINT) | sizeof(T);
+}
+
 } // end namespace detail
 
+
+/*****************************************************
+ * Worst case encoded sizes
+ *
+ * max_packed_size<T>::value is the largest number of
+ * bytes Packer::pack can emit for a T. It is only
+ * defined for fixed shape types, i.e. scalars and
+ * fixed size arrays of them.
+ *****************************************************/
+
+template<typename T, typename Enable = void>
+struct max_packed_size;
+
+template<>
+struct max_packed_size<bool> : std::integral_constant<size_t, 1> {};
+
+template<>
+struct max_packed_size<float> : std::integral_constant<size_t, 1 + sizeof(float)> {};
+
+template<>
+struct max_packed_size<double> : std::integral_constant<size_t, 1 + sizeof(double)> {};
+
+template<typename T>
+struct max_packed_size<T, typename std::enable_if<
+                            std::is_integral<T>::value && !std::is_const<T>::value && !std::is_same<T, bool>::value>::type>
+    : std::integral_constant<size_t, 1 + sizeof(T)> {};
+
+// const types only match here, so there is a single candidate for them
+template<typename T>
+struct max_packed_size<const T> : max_packed_size<T> {};
+
+// T arg[], packed as bin when sizeof(T) == 1
+template<typename T, std::size_t N>
+struct max_packed_size<T[N], typename std::enable_if<!std::is_const<T>::value && sizeof(T) == 1>::type>
+    : std::integral_constant<size_t, detail::bin_header_size(N) + N> {};
+
+template<typename T, std::size_t N>
+struct max_packed_size<T[N], typename std::enable_if<!std::is_const<T>::value && (sizeof(T) > 1)>::type>
+    : std::integral_constant<size_t, detail::array_header_size(N) + N * max_packed_size<T>::value> {};
+
+static_assert(max_packed_size<const int32_t>::value == max_packed_size<int32_t>::value &&
+              max_packed_size<const bool>::value == max_packed_size<bool>::value &&
+              max_packed_size<const double>::value == max_packed_size<double>::value &&
+              max_packed_size<const int16_t[3]>::value == max_packed_size<int16_t[3]>::value &&
+              max_packed_size<const char[4]>::value == max_packed_size<char[4]>::value,
+              "const types pack like their plain ones");
+
+
+//! Sum of max_packed_size over a parameter pack
+template<typename... Args>
+struct max_packed_size_of;
+
+template<>
+struct max_packed_size_of<> : std::integral_constant<size_t, 0> {};
+
+template<typename T, typename... Args>
+struct max_packed_size_of<T, Args...>
+    : std::integral_constant<size_t, max_packed_size<T>::value + max_packed_size_of<Args...>::value> {};
+
+//! Largest max_packed_size in a parameter pack
+template<typename... Args>
+struct max_packed_size_max;
+
+template<>
+struct max_packed_size_max<> : std::integral_constant<size_t, 0> {};
+
+template<typename T, typename... Args>
+struct max_packed_size_max<T, Args...>
+    : std::integral_constant<size_t, (max_packed_size<T>::value > max_packed_size_max<Args...>::value) ?
+                                     max_packed_size<T>::value : max_packed_size_max<Args...>::value> {};
+
+// std::array<T, N>, packed like T[N]
+template<typename T, std::size_t N>
+struct max_packed_size<std::array<T, N>> : max_packed_size<T[N]> {};
+
+// std::tuple and std::pair, packed as arrays
+template<typename... Args>
+struct max_packed_size<std::tuple<Args...>>
+    : std::integral_constant<size_t, detail::array_header_size(sizeof...(Args)) + max_packed_size_of<Args...>::value> {};
+
+template<typename T1, typename T2>
+struct max_packed_size<std::pair<T1, T2>> : max_packed_size<std::tuple<T1, T2>> {};
+
+#if __cplusplus >= 201703L
+
+// std::optional<T>, nil when empty
+template<typename T>
+struct max_packed_size<std::optional<T>> : max_packed_size<T> {};
+
+template<typename T>
+struct is_optional : std::false_type {};
+
+template<typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+// std::variant<Ts...>, an array of the index and the value
+template<typename... Ts>
+struct max_packed_size<std::variant<Ts...>>
+    : std::integral_constant<size_t, 1 + max_packed_size<size_t>::value + max_packed_size_max<Ts...>::value> {};
+
+#endif
+
+
 class PackerStatic
 {
     char*        base;
     char*        ptr;
     const size_t capacity;
     size_t       remaining;
+    bool         overflowed;
 
 public:
-    PackerStatic(char* p, size_t c) : base(p), ptr(p), capacity(c), remaining(c) {}
+    PackerStatic(char* p, size_t c) : base(p), ptr(p), capacity(c), remaining(c), overflowed(false) {}
 
     void write(const void* data, size_t length)
     {
-        if(remaining < length)
-            throw std::runtime_error("No space remaining in buffer");
+        if(remaining < length) {
+            overflowed = true;
+            detail::fail<std::runtime_error>("No space remaining in buffer");
+        }
 
         memcpy(ptr, data, length);
         remaining -= length;
         ptr += length;
     }
 
+    //! Checks capacity once, the caller writes up to length bytes at the returned position
+    char* reserve(size_t length)
+    {
+        if(remaining < length) {
+            overflowed = true;
+            detail::fail<std::runtime_error>("No space remaining in buffer");
+        }
+
+        return ptr;
+    }
+
+    void commit(char* end)
+    {
+        remaining -= end - ptr;
+        ptr = end;
+    }
+
     const char* data() const    { return static_cast<const char*>(base); }
     size_t      size() const    { return capacity - remaining;           }
-    void        reset()         { remaining = capacity; ptr = base;      }
+    bool        overflow() const { return overflowed;                    }
+    void        reset()         { remaining = capacity; ptr = base; overflowed = false; }
 };
 
 
@@ -132,8 +416,32 @@ public:
     void write(const void* data, size_t length)
     {
         const char* ptr = static_cast<const char*>(data);
+
+#ifdef MPCOMPACT_STATS
+        if(dataVec.capacity() - dataVec.size() < length)
+            stats::local().bufferGrowths++;
+#endif
+
         dataVec.insert(dataVec.end(), ptr, ptr+length);
     }
+
+    char* reserve(size_t length)
+    {
+        size_t offset = dataVec.size();
+
+#ifdef MPCOMPACT_STATS
+        if(dataVec.capacity() - offset < length)
+            stats::local().bufferGrowths++;
+#endif
+
+        dataVec.resize(offset + length);
+        return dataVec.data() + offset;
+    }
+
+    void commit(char* end)
+    {
+        dataVec.resize(end - dataVec.data());
+    }
 };
 
 
@@ -142,23 +450,53 @@ class Packer
     PackerStatic    staticPacker;
     PackerDynamic   dynamicPacker;
 
-    enum { STATIC, DYNAMIC } type;
+    enum { STATIC, DYNAMIC, RESERVED } type;
+    char*           cursor;     //!< Write position while RESERVED, see pack_fixed()
+
+    bool            validateUtf8;
+    bool            canonicalMode;
+    bool            compactFloats;
+
+    StringDictionary*   dictionary;
+    bool                incremental;
+    size_t              dictionaryMark; //!< Dictionary size when the message began
+
+    std::unique_ptr<detail::OutputHash> hasher;     //!< NULL unless hashing
 
 private:
+    /*
+     * Kept out of line so writes stay a plain copy while hashing is off.
+     * Static, as passing this would keep the write position in memory.
+     */
+    __attribute__ (( noinline, cold )) static void hash(detail::OutputHash* h, const void* data, size_t length)
+    {
+        h->update(data, length);
+    }
+
     Packer& write(const void* data, size_t length)
     {
-        if(type == DYNAMIC)
+        MPCOMPACT_STAT(bytesOut += length);
+        if(__builtin_expect(hasher != nullptr, 0))
+            hash(hasher.get(), data, length);
+
+        if(type == DYNAMIC) {
             dynamicPacker.write(data, length);
-        else
+        } else if(type == STATIC) {
             staticPacker.write(data, length);
+        } else {
+            memcpy(cursor, data, length);
+            cursor += length;
+        }
 
         
         return *this;
     }
 
+    //! Single values are always type heads
     template<typename T>
     Packer& write(T value)
     {
+        MPCOMPACT_STAT(tagsOut[static_cast<uint8_t>(value)]++);
         return(write(&value, sizeof(T)));
     }
 
@@ -174,13 +512,54 @@ private:
         buf.type = type;
         buf.value = value;
 
+        MPCOMPACT_STAT(tagsOut[type]++);
+
         return(write(&buf, sizeof(buf)));
     }
 
 
+    char* reserve(size_t length)
+    {
+        if(type == DYNAMIC)
+            return dynamicPacker.reserve(length);
+        else
+            return staticPacker.reserve(length);
+    }
+
+
+    void commit(char* end)
+    {
+        if(type == DYNAMIC)
+            dynamicPacker.commit(end);
+        else
+            staticPacker.commit(end);
+    }
+
+
+    void pack_each() {}
+
+    template<typename T, typename... Args>
+    void pack_each(const T& arg, const Args&... args)
+    {
+        pack(arg);
+        pack_each(args...);
+    }
+
+    template<typename Tuple, size_t... I>
+    Packer& pack_tuple(const Tuple& ref, detail::index_sequence<I...>)
+    {
+        pack_array_header(sizeof...(I));
+        pack_each(std::get<I>(ref)...);
+        return *this;
+    }
+
+
     template<typename T>
     Packer& pack_integral(T value) 
     {
+        // signed bounds, unsigned ones would convert negative values
+        const int64_t sValue = value;
+
         if(value >= 0)
         {
             if(value <= detail::MAX_7BIT)
@@ -204,19 +583,19 @@ private:
                 write<uint64_t>(detail::MP_UINT64, value);
             }
         } else {
-            if(value >= -(detail::MAX_5BIT + 1))
+            if(sValue >= -int64_t(detail::MAX_5BIT) - 1)
             {
                 write<int8_t>(static_cast<int8_t>(value) | detail::MP_NEGATIVE_FIXNUM);
             }
-            else if(value >= -(detail::MAX_7BIT + 1))
+            else if(sValue >= -int64_t(detail::MAX_7BIT) - 1)
             {
                 write<int8_t>(detail::MP_INT8, value);
             }
-            else if(value >= -(detail::MAX_15BIT + 1))
+            else if(sValue >= -int64_t(detail::MAX_15BIT) - 1)
             {
                 write<int16_t>(detail::MP_INT16, value);
             }
-            else if(value >= -(int64_t(detail::MAX_31BIT) + 1))
+            else if(sValue >= -int64_t(detail::MAX_31BIT) - 1)
             {
                 write<int32_t>(detail::MP_INT32, value);
             }
@@ -248,6 +627,9 @@ private:
     template<typename T>
     Packer& pack_floating_point(T value)
     {
+        if(compactFloats && pack_compact_float(value))
+            return *this;
+
         if(std::is_same<float,T>::value)
         {
             write<float>(detail::MP_FLOAT, value);
@@ -261,14 +643,87 @@ private:
     }
 
 
+    //! Packs value as an integer or float32 if that is lossless, false otherwise
+    template<typename T>
+    bool pack_compact_float(T value)
+    {
+        // never longer than a float32, so pack_fixed() stays within max_packed_size
+        if(std::is_same<float,T>::value && !(value >= -2147483648.0f && value < 4294967296.0f))
+            return false;
+
+        // 2^63, integral values in [-2^63, 2^64) fit int64 or uint64
+        const T limit = 9223372036854775808.0;
+
+        if(value >= -limit && value < limit)
+        {
+            int64_t i = static_cast<int64_t>(value);
+            if(static_cast<T>(i) == value && !(i == 0 && std::signbit(value))) {
+                pack_integral(i);
+                return true;
+            }
+        }
+        else if(value >= limit && value < 2 * limit)
+        {
+            uint64_t u = static_cast<uint64_t>(value);
+            if(static_cast<T>(u) == value) {
+                pack_integral(u);
+                return true;
+            }
+        }
+
+        if(!std::is_same<float,T>::value && static_cast<float>(value) == value)
+        {
+            write<float>(detail::MP_FLOAT, value);
+            return true;
+        }
+
+        return false;
+    }
+
+
+    template<typename T>
+    Packer& pack_string_ref(T id)
+    {
+        pack_ext_header(detail::MP_EXT_STRING_REF, sizeof(T));
+        return write(&id, sizeof(T));
+    }
+
+
     Packer& pack_string(const char* buffer, size_t length) 
     {
+        if(validateUtf8 && !detail::utf8_valid(buffer, length))
+            detail::fail<std::runtime_error>("Invalid UTF-8 string");
+
         if(length == 0)
         {
             write(detail::MP_NIL);
             return *this;
         }
-        else if(length <= detail::MAX_5BIT)
+
+        if(dictionary && length >= dictionary->min_length())
+        {
+            uint32_t id;
+            if(dictionary->find(buffer, length, id))
+            {
+                if(id <= detail::MAX_8BIT)
+                    return pack_string_ref<uint8_t>(id);
+                else if(id <= detail::MAX_16BIT)
+                    return pack_string_ref<uint16_t>(id);
+                else
+                    return pack_string_ref<uint32_t>(id);
+            }
+
+            if(incremental && !dictionary->full())
+            {
+                // add only once written, a failed write must not define the id
+                pack_ext_header(detail::MP_EXT_STRING_DEFINE, length);
+                write(buffer, length);
+                dictionary->add(buffer, length);
+                return *this;
+            }
+        }
+
+        if(length <= detail::MAX_5BIT)
         {
             write<uint8_t>(static_cast<uint8_t>(length) | detail::MP_FIXSTR);
         }
@@ -286,7 +741,7 @@ private:
         }
         else
         {
-            throw std::runtime_error("std::string size overflow");
+            detail::fail<std::runtime_error>("std::string size overflow");
         }
 
         write(buffer, length);
@@ -311,7 +766,7 @@ private:
         }
         else
         {
-            throw std::runtime_error("binary size overflow");
+            detail::fail<std::runtime_error>("binary size overflow");
         }
 
         write(buffer, length);
@@ -323,24 +778,9 @@ private:
     template<typename T>
     Packer& pack_array(const T* data, size_t size) 
     {
-        if(size <= detail::MAX_4BIT)
-        {
-            write<uint8_t>(static_cast<uint8_t>(size) | detail::MP_FIXARRAY);
-        }
-        else if(size <=  detail::MAX_16BIT)
-        {
-            write<uint16_t>(detail::MP_ARRAY16, size);
-        }
-        else if(size <= detail::MAX_32BIT)
-        {
-            write<uint32_t>(detail::MP_ARRAY32, size);
-        }
-        else
-        {
-            throw std::runtime_error("Array size overflow");
-        }
+        pack_array_header(size);
 
-        for(int i=0; i<size; i++)
+        for(size_t i=0; i<size; i++)
             pack(data[i]);
 
         return *this;
@@ -349,22 +789,7 @@ private:
     Packer& pack_array(const std::vector<bool>& ref)
     {
         size_t size = ref.size();
-        if(size <= detail::MAX_4BIT)
-        {
-            write<uint8_t>(static_cast<uint8_t>(size) | detail::MP_FIXARRAY);
-        }
-        else if(size <=  detail::MAX_16BIT)
-        {
-            write<uint16_t>(detail::MP_ARRAY16, size);
-        }
-        else if(size <= detail::MAX_32BIT)
-        {
-            write<uint32_t>(detail::MP_ARRAY32, size);
-        }
-        else
-        {
-            throw std::runtime_error("Array size overflow");
-        }
+        pack_array_header(size);
 
         for(size_t i=0; i<size; i++)
             pack(ref.at(i));
@@ -372,26 +797,28 @@ private:
         return *this;
     }
 
+    //! Ext header that never uses the fixext forms, see detail::ext_header_size()
+    Packer& pack_ext_sized_header(int8_t extType, size_t length)
+    {
+        if(length <= detail::MAX_8BIT)
+            write<uint8_t>(detail::MP_EXT8, length);
+        else if(length <= detail::MAX_16BIT)
+            write<uint16_t>(detail::MP_EXT16, length);
+        else if(length <= detail::MAX_32BIT)
+            write<uint32_t>(detail::MP_EXT32, length);
+        else
+            detail::fail<std::runtime_error>("ext size overflow");
+
+        return write(&extType, sizeof(extType));
+    }
+
     template<typename K, typename V>
     Packer& pack_map(const std::map<K,V>& ref)
     {
-        size_t size = ref.size();
-        if(size <= detail::MAX_4BIT)
-        {
-            write<uint8_t>(static_cast<uint8_t>(size) | detail::MP_FIXMAP);
-        }
-        else if(size <=  detail::MAX_16BIT)
-        {
-            write<uint16_t>(detail::MP_MAP16, size);
-        }
-        else if(size <= detail::MAX_32BIT)
-        {
-            write<uint32_t>(detail::MP_MAP32, size);
-        }
-        else
-        {
-            throw std::runtime_error("std::map size overflow");
-        }
+        if(canonicalMode)
+            return pack_canonical_map(ref);
+
+        pack_map_header(ref.size());
 
         for(auto& kv : ref) {
             pack(kv.first);
@@ -401,16 +828,145 @@ private:
         return *this;
     }
 
+    /*
+     * Entries ordered by the bytes of their encoded keys, so the output
+     * does not depend on the key type or comparator. The entries are
+     * encoded into a scratch Packer first, without the dictionary.
+     */
+    template<typename K, typename V>
+    Packer& pack_canonical_map(const std::map<K,V>& ref)
+    {
+        struct Entry
+        {
+            size_t key;
+            size_t value;
+            size_t end;
+        };
+
+        Packer scratch;
+        scratch.validateUtf8 = validateUtf8;
+        scratch.canonicalMode = true;
+        scratch.compactFloats = compactFloats;
+
+        std::vector<Entry> entries;
+        entries.reserve(ref.size());
+
+        for(auto& kv : ref) {
+            Entry e;
+            e.key = scratch.size();
+            e.value = scratch.pack(kv.first).size();
+            e.end = scratch.pack(kv.second).size();
+            entries.push_back(e);
+        }
+
+        const char* base = scratch.data();
+        std::sort(entries.begin(), entries.end(), [base](const Entry& a, const Entry& b) {
+            size_t la = a.value - a.key;
+            size_t lb = b.value - b.key;
+            int c = memcmp(base + a.key, base + b.key, std::min(la, lb));
+            return c < 0 || (c == 0 && la < lb);
+        });
+
+        pack_map_header(entries.size());
+        for(auto& e : entries)
+            write(base + e.key, e.end - e.key);
+
+        return *this;
+    }
+
 public:
-    Packer(char* p, size_t r) : staticPacker(p, r), dynamicPacker(), type(STATIC)  {}
-    Packer()                  : staticPacker(0, 0), dynamicPacker(), type(DYNAMIC) {}
+    Packer(char* p, size_t r)
+        : staticPacker(p, r), dynamicPacker(), type(STATIC), cursor(NULL), validateUtf8(false), canonicalMode(false),
+          compactFloats(false), dictionary(NULL), incremental(false), dictionaryMark(0), hasher() {}
+
+    Packer()
+        : staticPacker(0, 0), dynamicPacker(), type(DYNAMIC), cursor(NULL), validateUtf8(false), canonicalMode(false),
+          compactFloats(false), dictionary(NULL), incremental(false), dictionaryMark(0), hasher() {}
+
+    //! Reject strings that are not valid UTF-8
+    void validate_utf8(bool enable) { validateUtf8 = enable; }
+
+    /*
+     * Packs strings found in d as ext references to their id. With inc
+     * set, other strings of at least d's minimum length are added to d
+     * and sent once as a definition, while d has room. A message that is
+     * not sent must be discard()ed, so d forgets what it defined.
+     */
+    void use_dictionary(StringDictionary* d, bool inc = true)
+    {
+        dictionary = d;
+        incremental = inc;
+        dictionaryMark = d ? d->size() : 0;
+    }
+
+    /*
+     * Canonical encoding: equal content always packs to equal bytes, map
+     * entries are sorted by their encoded keys. Integers always use their
+     * minimal width, canonical or not.
+     */
+    void canonical(bool enable) { canonicalMode = enable; }
+
+    /*
+     * Packs floating point values as an integer when they are whole, or
+     * a double as float32 when that is exact. -0.0 is never packed as an
+     * integer, nor a float that needs more than a 32 bit one. Unpacker
+     * reads both back into floating point targets.
+     */
+    void compact_floats(bool enable) { compactFloats = enable; }
+
+    /*
+     * Hashes the output as it is written, XXH64 with seed 0 and with wide
+     * set a second one with another seed for hash128(). Starts over on
+     * reset(), bytes written before enabling are not included.
+     */
+    void hash_output(bool enable, bool wide = false)
+    {
+        hasher.reset(enable ? new detail::OutputHash(wide) : NULL);
+    }
+
+    uint64_t hash64() const
+    {
+        if(!hasher)
+            detail::fail<std::logic_error>("Output hashing not enabled");
+
+        return hasher->digest64();
+    }
+
+    Hash128 hash128() const
+    {
+        if(!hasher || !hasher->is_wide())
+            detail::fail<std::logic_error>("Wide output hashing not enabled");
+
+        return hasher->digest128();
+    }
 
+    //! Empties the output for the next message, keeping what it defined in the dictionary
     void reset()
     {
         if(type == DYNAMIC)
             dynamicPacker.reset();
         else
             staticPacker.reset();
+
+        if(hasher)
+            hasher->reset();
+
+        if(dictionary)
+            dictionaryMark = dictionary->size();
+    }
+
+    /*
+     * Empties the output of a message that is not sent, and drops the
+     * strings it added to the dictionary since use_dictionary() or
+     * reset(). Later messages would otherwise refer to definitions the
+     * reader never saw.
+     */
+    void discard()
+    {
+        if(dictionary)
+            dictionary->truncate(dictionaryMark);
+
+        reset();
     }
 
     const char* data() const
@@ -430,6 +986,12 @@ public:
             return staticPacker.size();
     }
 
+    //! True once a write did not fit the fixed buffer, until reset()
+    bool overflow() const
+    {
+        return type != DYNAMIC && staticPacker.overflow();
+    }
+
 
     Packer& pack(const char& arg)       { return pack_integral(arg);        }
     Packer& pack(const uint8_t& arg)    { return pack_integral(arg);        }
@@ -469,20 +1031,252 @@ public:
 
     template<typename K, typename V>
     Packer& pack(const std::map<K,V>& arg)      { return pack_map(arg);                     }
-};
-    
 
-class Unpacker
-{
-    const char* readBufferPtr;
-    size_t      remaining;
+    // std::array<T, N>, packed like T[N]
+    template<typename T, std::size_t N>
+    typename std::enable_if<sizeof(T) == 1, Packer&>::type
+    pack(const std::array<T, N>& arg)       { return pack_binary(arg.data(), N);            }
+
+    template<typename T, std::size_t N>
+    typename std::enable_if<(sizeof(T) > 1), Packer&>::type
+    pack(const std::array<T, N>& arg)       { return pack_array(arg.data(), N);             }
+
+    // std::tuple and std::pair, packed as arrays
+    template<typename... Args>
+    Packer& pack(const std::tuple<Args...>& arg)
+    {
+        return pack_tuple(arg, detail::make_index_sequence<sizeof...(Args)>());
+    }
+
+    template<typename T1, typename T2>
+    Packer& pack(const std::pair<T1, T2>& arg)
+    {
+        pack_array_header(2);
+        return pack(arg.first).pack(arg.second);
+    }
+
+#if __cplusplus >= 201703L
+    //! Nil when empty, so an engaged value must never pack as nil itself
+    template<typename T>
+    Packer& pack(const std::optional<T>& arg)
+    {
+        static_assert(!is_optional<T>::value, "An empty inner optional would read back as an empty outer one");
+
+        if(!arg)
+            return write(detail::MP_NIL);
+
+        return pack_engaged(*arg);
+    }
+
+    template<typename T>
+    Packer& pack_engaged(const T& arg) { return pack(arg); }
+
+    //! pack_string() writes empty strings as nil, fixstr 0 keeps them engaged
+    Packer& pack_engaged(const std::string& arg)
+    {
+        if(arg.empty())
+            return write(detail::MP_FIXSTR);
+
+        return pack(arg);
+    }
+
+    //! Array of the alternative index and the value
+    template<typename... Ts>
+    Packer& pack(const std::variant<Ts...>& arg)
+    {
+        if(arg.valueless_by_exception())
+            detail::fail<std::runtime_error>("Variant is valueless");
+
+        pack_array_header(2);
+        pack_integral(arg.index());
+        std::visit([this](const auto& value) { pack(value); }, arg);
+        return *this;
+    }
+#endif
+
+
+    //! Header of an array whose size elements the caller packs next
+    Packer& pack_array_header(size_t size)
+    {
+        if(size <= detail::MAX_4BIT)
+        {
+            write<uint8_t>(static_cast<uint8_t>(size) | detail::MP_FIXARRAY);
+        }
+        else if(size <=  detail::MAX_16BIT)
+        {
+            write<uint16_t>(detail::MP_ARRAY16, size);
+        }
+        else if(size <= detail::MAX_32BIT)
+        {
+            write<uint32_t>(detail::MP_ARRAY32, size);
+        }
+        else
+        {
+            detail::fail<std::runtime_error>("Array size overflow");
+        }
+
+        return *this;
+    }
+
+
+    //! Header of an ext value whose length payload bytes the caller writes next
+    Packer& pack_ext_header(int8_t extType, size_t length)
+    {
+        switch(length)
+        {
+            case 1:     write<uint8_t>(detail::MP_FIXEXT1);     break;
+            case 2:     write<uint8_t>(detail::MP_FIXEXT1 + 1); break;
+            case 4:     write<uint8_t>(detail::MP_FIXEXT1 + 2); break;
+            case 8:     write<uint8_t>(detail::MP_FIXEXT1 + 3); break;
+            case 16:    write<uint8_t>(detail::MP_FIXEXT16);    break;
+            default:    return pack_ext_sized_header(extType, length);
+        }
+
+        return write(&extType, sizeof(extType));
+    }
+
+
+    //! Header of a map whose size key/value pairs the caller packs next
+    Packer& pack_map_header(size_t size)
+    {
+        if(size <= detail::MAX_4BIT)
+        {
+            write<uint8_t>(static_cast<uint8_t>(size) | detail::MP_FIXMAP);
+        }
+        else if(size <=  detail::MAX_16BIT)
+        {
+            write<uint16_t>(detail::MP_MAP16, size);
+        }
+        else if(size <= detail::MAX_32BIT)
+        {
+            write<uint32_t>(detail::MP_MAP32, size);
+        }
+        else
+        {
+            detail::fail<std::runtime_error>("std::map size overflow");
+        }
+
+        return *this;
+    }
+
+
+    /*
+     * Packs size numeric elements as one ext value holding their memory
+     * image, so encoding is a single copy. The elements are padded to be
+     * aligned relative to the start of the output, which lets Unpacker
+     * return them in place, see Unpacker::unpack_typed_array().
+     */
+    template<typename T>
+    Packer& pack_typed_array(const T* data, size_t size)
+    {
+        static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value,
+                      "Typed arrays hold integral or floating point elements");
+
+        if(size > detail::MAX_32BIT / sizeof(T))
+            detail::fail<std::runtime_error>("Typed array size overflow");
+
+        const size_t bytes = size * sizeof(T);
+
+        /*
+         * Within a size class of the ext header this ends in under sizeof(T)
+         * steps. Padding can push the length into the next class, which only
+         * happens once as classes are at least 255 bytes apart, and the longer
+         * header takes up to sizeof(T) - 1 more. So padding is at most
+         * 2 * sizeof(T) - 2, 14 for 8 byte elements (13 is reached), and
+         * fits both the flags nibble and the TYPED_PADDING bytes of zeros.
+         */
+        uint8_t padding = 0;
+        while((this->size() + detail::ext_header_size(detail::TYPED_HEADER + padding + bytes) +
+               detail::TYPED_HEADER + padding) % sizeof(T))
+            padding++;
+
+        pack_ext_sized_header(detail::MP_EXT_TYPED_ARRAY, detail::TYPED_HEADER + padding + bytes);
+
+        const uint8_t head[detail::TYPED_HEADER] = {
+            detail::typed_code<T>(), uint8_t(detail::TYPED_NATIVE_ORDER | padding)
+        };
+        const char zeros[detail::TYPED_PADDING] = {};
+
+        write(head, sizeof(head));
+        write(zeros, padding);
+        return write(data, bytes);
+    }
+
+    template<typename T>
+    Packer& pack_typed_array(const std::vector<T>& ref) { return pack_typed_array(ref.data(), ref.size()); }
+
+
+    /*
+     * Packs fixed shape values in order, checking the buffer capacity once
+     * for their combined max_packed_size and then writing without further
+     * checks. Throws if the worst case does not fit even if the actual
+     * encoding would. Bytes and options are the same as for pack().
+     */
+    template<typename... Args>
+    Packer& pack_fixed(const Args&... args)
+    {
+        const size_t length = max_packed_size_of<Args...>::value;
+
+        // writes only advance the cursor until the span is committed
+        decltype(type) outer = type;
+        cursor = reserve(length);
+        char* start = cursor;
+        type = RESERVED;
+
+        try {
+            pack_each(args...);
+        } catch(...) {
+            type = outer;
+            commit(start);
+            throw;
+        }
+
+        type = outer;
+        commit(cursor);
+
+        return *this;
+    }
+};
+    
+
+class Unpacker
+{
+    const char* readBufferPtr;
+    size_t      remaining;
+    bool        validateUtf8;
+
+    StringDictionary*   dictionary;
+
+    size_t      budget;     //!< Bytes decoded containers may still allocate
+    size_t      maxDepth;
+    size_t      depth;
+
+    static const size_t NO_LIMIT = ~size_t(0);
 
 private:
+    //! Counts one level of container nesting while it lives
+    class Nested
+    {
+        Unpacker& unpacker;
+
+    public:
+        explicit Nested(Unpacker& u) : unpacker(u)
+        {
+            if(unpacker.depth == unpacker.maxDepth)
+                detail::fail<std::overflow_error>("Nesting depth exceeded");
+
+            unpacker.depth++;
+        }
+
+        ~Nested() { unpacker.depth--; }
+    };
+
     Unpacker& consume(size_t length)
     {
         if(remaining < length)
-            throw std::runtime_error("No bytes remaining in buffer");
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
     
+        MPCOMPACT_STAT(bytesIn += length);
         readBufferPtr += length;
         remaining -= length;
 
@@ -492,9 +1286,10 @@ private:
     void read(void* dst, size_t length)
     {
         if(remaining < length)
-            throw std::runtime_error("No bytes remaining in buffer");
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
 
         memcpy(dst, readBufferPtr, length);
+        MPCOMPACT_STAT(bytesIn += length);
 
         readBufferPtr += length;
         remaining -= length;
@@ -505,9 +1300,10 @@ private:
     {
 
         if(remaining < sizeof(T))
-            throw std::runtime_error("No bytes remaining in buffer");
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
 
         T value = *reinterpret_cast<const T*>(readBufferPtr);
+        MPCOMPACT_STAT(bytesIn += sizeof(T));
 
         readBufferPtr += sizeof(T);
         remaining -= sizeof(T);
@@ -520,7 +1316,7 @@ private:
     T peek()
     {
         if(remaining < sizeof(T))
-            throw std::runtime_error("No bytes remaining in buffer");
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
 
         T value = *reinterpret_cast<const T*>(readBufferPtr);
 
@@ -528,56 +1324,95 @@ private:
     }
 
 
-    template<typename T>
-    Unpacker& unpack_integral(T& ref)
+    uint8_t read_head()
     {
         uint8_t head = read<uint8_t>();
+        MPCOMPACT_STAT(tagsIn[head]++);
+        return head;
+    }
 
-        if((head & detail::TYPE_1BIT) == detail::MP_FIXNUM) {
-            ref = head & detail::VALUE_7BIT;
-            return *this;
-        }
 
-        if((head & detail::TYPE_3BIT) == detail::MP_NEGATIVE_FIXNUM) {
-            ref = -(head & detail::VALUE_5BIT);
-            return *this;
+    uint64_t read_unsigned(uint8_t width)
+    {
+        switch(width)
+        {
+            case 1:     return read<uint8_t>();
+            case 2:     return read<uint16_t>();
+            case 4:     return read<uint32_t>();
+            default:    return read<uint64_t>();
         }
+    }
 
-        
-        uint64_t uVal = 0;
-        int64_t sVal  = 0;
-        enum { S, U } type;
-        switch(head)
-        {
-            case detail::MP_UINT8:  uVal = read<uint8_t>();  type = U; break;
-            case detail::MP_UINT16: uVal = read<uint16_t>(); type = U; break;
-            case detail::MP_UINT32: uVal = read<uint32_t>(); type = U; break;
-            case detail::MP_UINT64: uVal = read<uint64_t>(); type = U; break;
-            case detail::MP_INT8:   sVal = read<int8_t>();   type = S; break;
-            case detail::MP_INT16:  sVal = read<int16_t>();  type = S; break;
-            case detail::MP_INT32:  sVal = read<int32_t>();  type = S; break;
-            case detail::MP_INT64:  sVal = read<int64_t>();  type = S; break;
 
-            default:    throw std::runtime_error("Invalid type received");
+    int64_t read_signed(uint8_t width)
+    {
+        switch(width)
+        {
+            case 1:     return read<int8_t>();
+            case 2:     return read<int16_t>();
+            case 4:     return read<int32_t>();
+            default:    return read<int64_t>();
         }
+    }
+
+
+    //! Inline or following value/length of a head described by info
+    uint64_t read_length(const detail::TypeInfo& info)
+    {
+        return info.width == 0 ? static_cast<uint8_t>(info.value) : read_unsigned(info.width);
+    }
+
+
+    //! Reads a head of the given type and returns its length
+    size_t read_length(Type type)
+    {
+        const detail::TypeInfo& info = detail::TYPE_TABLE[read_head()];
+        if(info.type != type)
+            detail::fail<std::runtime_error>("Invalid type received");
+
+        return read_length(info);
+    }
+
+
+    //! Reads a container head, rejecting counts the remaining input can not hold
+    size_t read_count(Type type, size_t minimum)
+    {
+        size_t count = read_length(type);
+        if(count > remaining / minimum)
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
+
+        return count;
+    }
+
 
-        if(type == U)
+    template<typename T>
+    Unpacker& unpack_integral(T& ref)
+    {
+        const detail::TypeInfo& info = detail::TYPE_TABLE[read_head()];
+
+        if(info.type == TYPE_UINT)
         {
+            uint64_t uVal = info.width == 0 ? info.value : read_unsigned(info.width);
             if(uVal > std::numeric_limits<T>::max())
-                throw std::overflow_error("Value overflows numeric limit");
+                detail::fail<std::overflow_error>("Value overflows numeric limit");
 
             ref = uVal;
         }
-        else
+        else if(info.type == TYPE_INT)
         {
-            if(sVal > std::numeric_limits<T>::max())
-                throw std::overflow_error("Value overflows numeric limit");
+            int64_t sVal = info.width == 0 ? info.value : read_signed(info.width);
+            if(sVal >= 0 && uint64_t(sVal) > uint64_t(std::numeric_limits<T>::max()))
+                detail::fail<std::overflow_error>("Value overflows numeric limit");
 
-            if(sVal < std::numeric_limits<T>::min())
-                throw std::underflow_error("Value underflows numeric limit");
+            if(sVal < 0 && sVal < int64_t(std::numeric_limits<T>::min()))
+                detail::fail<std::underflow_error>("Value underflows numeric limit");
 
             ref = sVal;
         }
+        else
+        {
+            detail::fail<std::runtime_error>("Invalid type received");
+        }
 
         return *this;
     }
@@ -585,130 +1420,181 @@ private:
 
     Unpacker& unpack_boolean(bool& ref)
     {
-        uint8_t head = read<uint8_t>();
-        if(head == detail::MP_TRUE)
-        {
-            ref = true;
-        }
-        else if(head == detail::MP_FALSE)
-        {
-            ref = false;
-        }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
-        }
+        const detail::TypeInfo& info = detail::TYPE_TABLE[read_head()];
+        if(info.type != TYPE_BOOLEAN)
+            detail::fail<std::runtime_error>("Invalid type received");
 
+        ref = info.value;
         return *this;
     }
 
     template<typename T>
     Unpacker& unpack_floating_point(T& ref)
     {
-        uint8_t head = read<uint8_t>();
-        if(head == detail::MP_FLOAT)
+        const detail::TypeInfo& info = detail::TYPE_TABLE[read_head()];
+
+        // whole numbers from Packer::compact_floats()
+        if(info.type == TYPE_UINT)
+        {
+            ref = static_cast<T>(read_length(info));
+        }
+        else if(info.type == TYPE_INT)
+        {
+            ref = static_cast<T>(info.width == 0 ? info.value : read_signed(info.width));
+        }
+        else if(info.type != TYPE_FLOAT)
+        {
+            detail::fail<std::runtime_error>("Invalid type received");
+        }
+        else if(info.width == sizeof(float))
         {
             ref = read<float>();
         }
-        else if(head == detail::MP_DOUBLE)
+        else
         {
             double value = read<double>();
-            if(value > std::numeric_limits<T>::max())
-                throw std::overflow_error("Value overflows numeric limit");
-
-            if(value < std::numeric_limits<T>::min())
-                throw std::underflow_error("Value underflows numeric limit");
+            if(std::isfinite(value))
+            {
+                if(value > std::numeric_limits<T>::max())
+                    detail::fail<std::overflow_error>("Value overflows numeric limit");
 
+                if(value < std::numeric_limits<T>::lowest())
+                    detail::fail<std::underflow_error>("Value underflows numeric limit");
+            }
 
             ref = value;
         }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
-        }
 
         return *this;
     }
 
 
-    Unpacker& unpack_string(std::string& ref)
+    //! Consumes a str (or nil) and returns its bytes in the input buffer
+    const char* read_string(size_t& length)
     {
-        uint8_t head = read<uint8_t>();
+        const detail::TypeInfo& info = detail::TYPE_TABLE[read_head()];
 
-        size_t length;
-        if(head == detail::MP_NIL)
-        {
-            ref.clear();
-            return *this;
-        }
-        else if((head & detail::TYPE_3BIT) == detail::MP_FIXSTR) 
+        if(info.type == TYPE_NIL)
         {
-            length = head & detail::VALUE_5BIT;
+            length = 0;
+            return readBufferPtr;
         }
-        else if(head == detail::MP_STR8)
+        else if(info.type == TYPE_EXT && dictionary)
         {
-            length = read<uint8_t>();
+            return read_dictionary_string(info, length);
         }
-        else if(head == detail::MP_STR16)
+        else if(info.type != TYPE_STRING)
         {
-            length = read<uint16_t>();
-        }
-        else if(head == detail::MP_STR32)
-        {
-            length = read<uint32_t>();
-        }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
+            detail::fail<std::runtime_error>("Invalid type received");
         }
 
+        length = read_length(info);
+
         // direct access for performance reasons
         if(remaining < length)
-            throw std::runtime_error("No bytes remaining in buffer");
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
+
+        if(validateUtf8 && !detail::utf8_valid(readBufferPtr, length))
+            detail::fail<std::runtime_error>("Invalid UTF-8 string");
 
-        ref.assign(readBufferPtr, length);
+        const char* ptr = readBufferPtr;
         consume(length);
-    
-        return *this;
+
+        return ptr;
     }
 
 
-    Unpacker& unpack_c_string(char* ptr, size_t size)
+    const char* read_dictionary_string(const detail::TypeInfo& info, size_t& length)
     {
-        uint8_t head = read<uint8_t>();
+        size_t size = read_length(info);
+        int8_t extType = read<int8_t>();
 
-        size_t length;
-        if(head == detail::MP_NIL)
+        uint32_t id;
+        if(extType == detail::MP_EXT_STRING_REF && (size == 1 || size == 2 || size == 4))
         {
-            *ptr = 0;
-            return *this;
-        }
-        else if((head & detail::TYPE_3BIT) == detail::MP_FIXSTR) 
-        {
-            length = head & detail::VALUE_5BIT;
-        }
-        else if(head == detail::MP_STR8)
-        {
-            length = read<uint8_t>();
-        }
-        else if(head == detail::MP_STR16)
-        {
-            length = read<uint16_t>();
+            id = read_unsigned(size);
+            if(id >= dictionary->size())
+                detail::fail<std::runtime_error>("Unknown dictionary string");
         }
-        else if(head == detail::MP_STR32)
+        else if(extType == detail::MP_EXT_STRING_DEFINE)
         {
-            length = read<uint32_t>();
+            if(remaining < size)
+                detail::fail<std::runtime_error>("No bytes remaining in buffer");
+
+            if(dictionary->full())
+                detail::fail<std::overflow_error>("String dictionary overflow");
+
+            charge<1>(size);
+
+            if(validateUtf8 && !detail::utf8_valid(readBufferPtr, size))
+                detail::fail<std::runtime_error>("Invalid UTF-8 string");
+
+            id = dictionary->add(readBufferPtr, size);
+            consume(size);
         }
         else
         {
-            throw std::runtime_error("Invalid type received");
+            detail::fail<std::runtime_error>("Invalid type received");
         }
 
+        const std::string& ref = dictionary->at(id);
+        length = ref.size();
+        return ref.data();
+    }
+
+
+    Unpacker& unpack_string(std::string& ref)
+    {
+        size_t length;
+        const char* ptr = read_string(length);
+
+        charge<1>(length);
+        ref.assign(ptr, length);
+    
+        return *this;
+    }
+
+
+    //! Consumes a typed array of T, returns its elements in the input buffer
+    template<typename T>
+    const char* read_typed_array(size_t& size, bool& swap)
+    {
+        size_t length = read_length(TYPE_EXT);
+        if(read<int8_t>() != detail::MP_EXT_TYPED_ARRAY || length < detail::TYPED_HEADER)
+            detail::fail<std::runtime_error>("Invalid type received");
+
+        if(remaining < length)
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
+
+        const uint8_t code  = readBufferPtr[0];
+        const uint8_t flags = readBufferPtr[1];
+        const size_t  bytes = length - detail::TYPED_HEADER - (flags & detail::TYPED_PADDING);
+
+        if(code != detail::typed_code<T>())
+            detail::fail<std::runtime_error>("Typed array element mismatch");
+
+        if(bytes > length || bytes % sizeof(T))
+            detail::fail<std::runtime_error>("Invalid typed array");
+
+        const char* ptr = readBufferPtr + length - bytes;
+        consume(length);
+
+        size = bytes / sizeof(T);
+        swap = (flags & detail::TYPED_BIG_ENDIAN) != detail::TYPED_NATIVE_ORDER;
+        return ptr;
+    }
+
+
+    Unpacker& unpack_c_string(char* ptr, size_t size)
+    {
+        size_t length;
+        const char* src = read_string(length);
+
         if(length > size)
-            throw std::overflow_error("String buffer overflow");
+            detail::fail<std::overflow_error>("String buffer overflow");
 
+        memcpy(ptr, src, length);
         memset(ptr+length, 0, size-length); 
-        read(ptr, length);
 
         return *this;
     }
@@ -716,28 +1602,10 @@ private:
 
     Unpacker& unpack_binary(void* buffer, size_t size)
     {
-        uint8_t head = read<uint8_t>();
-
-        size_t length;
-        if(head == detail::MP_BIN8)
-        {
-            length = read<uint8_t>();
-        }
-        else if(head == detail::MP_BIN16)
-        {
-            length = read<uint16_t>();
-        }
-        else if(head == detail::MP_BIN32)
-        {
-            length = read<uint32_t>();
-        }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
-        }
+        size_t length = read_length(TYPE_BINARY);
 
         if(length != size)
-            throw std::overflow_error("Binary buffer size mismatch");
+            detail::fail<std::overflow_error>("Binary buffer size mismatch");
 
         read(buffer, length);
     
@@ -748,26 +1616,12 @@ private:
     template<typename T>
     Unpacker& unpack_binary(std::vector<T>& ref)
     {
-        uint8_t head = read<uint8_t>();
+        size_t length = read_length(TYPE_BINARY);
 
-        size_t length;
-        if(head == detail::MP_BIN8)
-        {
-            length = read<uint8_t>();
-        }
-        else if(head == detail::MP_BIN16)
-        {
-            length = read<uint16_t>();
-        }
-        else if(head == detail::MP_BIN32)
-        {
-            length = read<uint32_t>();
-        }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
-        }
+        if(remaining < length)
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
 
+        charge<1>(length);
         ref.resize(length);
 
         read(ref.data(), length);
@@ -779,88 +1633,53 @@ private:
     template<typename T>
     Unpacker& unpack_array(T* data, size_t size) 
     {
-        uint8_t head = read<uint8_t>();
-
-        size_t elements;
-        if((head & detail::TYPE_4BIT) == detail::MP_FIXARRAY)
-        {
-            elements = (head & detail::VALUE_4BIT);
-        }
-        else if(head == detail::MP_ARRAY16)
-        {
-            elements = read<uint16_t>();
-        }
-        else if(head == detail::MP_ARRAY32)
-        {
-            elements = read<uint32_t>();
-        }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
-        }
+        Nested nested(*this);
+        size_t elements = read_length(TYPE_ARRAY);
 
         if(elements != size)
-            throw std::runtime_error("Array size mismatch");
+            detail::fail<std::runtime_error>("Array size mismatch");
         
-        for(int i=0; i<size; i++)
+        for(size_t i=0; i<size; i++)
             unpack(data[i]);
 
         return *this;
     }
 
 
+    /*
+     * Every element takes at least one byte of input, but may need far
+     * more memory. When the count would allocate more than the remaining
+     * input, or than ref already holds, the vector grows with the elements
+     * actually decoded instead.
+     */
     template<typename T>
     Unpacker& unpack_array(std::vector<T>& ref)
     {
-        uint8_t head = read<uint8_t>();
+        Nested nested(*this);
+        size_t elements = read_count(TYPE_ARRAY, 1);
+        charge<sizeof(T)>(elements);
 
-        size_t elements;
-        if((head & detail::TYPE_4BIT) == detail::MP_FIXARRAY)
-        {
-            elements = (head & detail::VALUE_4BIT);
-        }
-        else if(head == detail::MP_ARRAY16)
-        {
-            elements = read<uint16_t>();
-        }
-        else if(head == detail::MP_ARRAY32)
-        {
-            elements = read<uint32_t>();
-        }
-        else
+        size_t size = std::min(elements, std::max(ref.size(), remaining / sizeof(T)));
+        ref.resize(size);
+
+        for(size_t i=0; i<elements; )
         {
-            throw std::runtime_error("Invalid type received");
-        }
+            if(i == size) {
+                size = std::min(elements, 2 * size + 16);
+                ref.resize(size);
+            }
 
-        ref.resize(elements);
-        
-        for(size_t i=0; i<elements; i++)
-            unpack(ref.at(i));
+            for(; i<size; i++)
+                unpack(ref.at(i));
+        }
 
         return *this;
     }
 
     Unpacker& unpack_array(std::vector<bool>& ref)
     {
-        uint8_t head = read<uint8_t>();
-
-        size_t elements;
-        if((head & detail::TYPE_4BIT) == detail::MP_FIXARRAY)
-        {
-            elements = (head & detail::VALUE_4BIT);
-        }
-        else if(head == detail::MP_ARRAY16)
-        {
-            elements = read<uint16_t>();
-        }
-        else if(head == detail::MP_ARRAY32)
-        {
-            elements = read<uint32_t>();
-        }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
-        }
+        size_t elements = read_count(TYPE_ARRAY, 1);
+        charge<1>(elements / 8 + 1);
 
         ref.resize(elements);
 
@@ -877,25 +1696,11 @@ private:
     template<typename K, typename V>
     Unpacker& unpack_map(std::map<K,V>& ref)
     {
-        uint8_t head = read<uint8_t>();
+        Nested nested(*this);
+        size_t elements = read_count(TYPE_MAP, 2);
 
-        size_t elements;
-        if((head & detail::TYPE_4BIT) == detail::MP_FIXMAP)
-        {
-            elements = (head & detail::VALUE_4BIT);
-        }
-        else if(head == detail::MP_MAP16)
-        {
-            elements = read<uint16_t>();
-        }
-        else if(head == detail::MP_MAP32)
-        {
-            elements = read<uint32_t>();
-        }
-        else
-        {
-            throw std::runtime_error("Invalid type received");
-        }
+        // a tree node holds the entry, its color and three links
+        charge<sizeof(typename std::map<K,V>::value_type) + 4 * sizeof(void*)>(elements);
 
         K key;
         V value;
@@ -909,16 +1714,158 @@ private:
         return *this;
     }
 
+    void unpack_each() {}
+
+    template<typename T, typename... Args>
+    void unpack_each(T& arg, Args&... args)
+    {
+        unpack(arg);
+        unpack_each(args...);
+    }
+
+    template<typename Tuple, size_t... I>
+    Unpacker& unpack_tuple(Tuple& ref, detail::index_sequence<I...>)
+    {
+        Nested nested(*this);
+        if(read_length(TYPE_ARRAY) != sizeof...(I))
+            detail::fail<std::runtime_error>("Array size mismatch");
+
+        unpack_each(std::get<I>(ref)...);
+        return *this;
+    }
+
+#if __cplusplus >= 201703L
+    template<typename V, size_t I>
+    void unpack_alternative(V& ref) { unpack(ref.template emplace<I>()); }
+
+    //! Emplaces alternative index through a table built at compile time
+    template<typename V, size_t... I>
+    Unpacker& unpack_variant(V& ref, size_t index, detail::index_sequence<I...>)
+    {
+        typedef void (Unpacker::*Alternative)(V&);
+        static constexpr Alternative table[] = { &Unpacker::unpack_alternative<V, I>... };
+
+        if(index >= sizeof...(I))
+            detail::fail<std::runtime_error>("Variant index out of range");
+
+        (this->*table[index])(ref);
+        return *this;
+    }
+#endif
+
+    //! Consumes what follows the head of a value that is not a container
+    void skip_payload(const detail::TypeInfo& info)
+    {
+        switch(info.type)
+        {
+            case TYPE_NIL:
+            case TYPE_BOOLEAN:  break;
+            case TYPE_UINT:
+            case TYPE_INT:
+            case TYPE_FLOAT:    consume(info.width);                break;
+            case TYPE_STRING:
+            case TYPE_BINARY:   consume(read_length(info));         break;
+            case TYPE_EXT:      consume(read_length(info) + 1);     break;
+
+            default:    detail::fail<std::runtime_error>("Invalid type received");
+        }
+    }
+
+    void skip_nested()
+    {
+        const detail::TypeInfo& info = detail::TYPE_TABLE[read_head()];
+        if(info.type != TYPE_ARRAY && info.type != TYPE_MAP) {
+            skip_payload(info);
+            return;
+        }
+
+        Nested nested(*this);
+        uint64_t values = read_length(info) * (info.type == TYPE_MAP ? 2 : 1);
+        while(values--)
+            skip_nested();
+    }
+
     friend void toString(mpcompact::Unpacker&, std::string&, bool);
 
 public:
     Unpacker(const char* p, size_t r)
-        : readBufferPtr(p), remaining(r) {}
+        : readBufferPtr(p), remaining(r), validateUtf8(false), dictionary(NULL),
+          budget(NO_LIMIT), maxDepth(NO_LIMIT), depth(0) {}
+
+    //! Reject received strings that are not valid UTF-8
+    void validate_utf8(bool enable) { validateUtf8 = enable; }
+
+    /*
+     * Caps the bytes that strings, vectors, maps, column batches and
+     * dictionary strings decoded from here on may allocate in total.
+     * Unlimited by default, exceeding it throws before allocating.
+     */
+    void memory_budget(size_t bytes)    { budget = bytes;   }
+    size_t budget_left() const          { return budget;    }
+
+    /*
+     * Takes count elements of Size bytes from the budget, for types that
+     * allocate while decoding. Call it before allocating them.
+     */
+    template<size_t Size>
+    void charge(size_t count)
+    {
+        if(count > budget / Size)
+            detail::fail<std::overflow_error>("Memory budget exceeded");
+
+        budget -= count * Size;
+    }
+
+    /*
+     * Caps how deeply containers may nest, in typed values and skip().
+     * Unlimited by default. With a limit skip() recurses up to that deep.
+     */
+    void max_depth(size_t levels)       { maxDepth = levels; }
+
+    //! Resolves dictionary strings from d, see Packer::use_dictionary()
+    void use_dictionary(StringDictionary* d) { dictionary = d; }
 
     size_t size() const { return remaining; }
     void consumeAll()   { remaining = 0;    }
 
 
+    //! Type of the next value, without consuming it
+    Type next_type() const
+    {
+        if(remaining == 0)
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
+
+        return static_cast<Type>(detail::TYPE_TABLE[static_cast<uint8_t>(*readBufferPtr)].type);
+    }
+
+
+    //! Skips the next value, including the contents of containers
+    Unpacker& skip()
+    {
+        // nesting is only tracked when limited, that walk recurses
+        if(maxDepth != NO_LIMIT) {
+            skip_nested();
+            return *this;
+        }
+
+        size_t pending = 1;
+        while(pending)
+        {
+            const detail::TypeInfo& info = detail::TYPE_TABLE[read_head()];
+            pending--;
+
+            switch(info.type)
+            {
+                case TYPE_ARRAY:    pending += read_length(info);       break;
+                case TYPE_MAP:      pending += 2 * read_length(info);   break;
+                default:            skip_payload(info);
+            }
+        }
+
+        return *this;
+    }
+
+
     Unpacker& unpack(char& arg)     { return unpack_integral<char>(arg);        }
     Unpacker& unpack(uint8_t& arg)  { return unpack_integral<uint8_t>(arg);     }
     Unpacker& unpack(uint16_t& arg) { return unpack_integral<uint16_t>(arg);    }
@@ -935,6 +1882,13 @@ public:
     Unpacker& unpack(std::string& arg)      { return unpack_string(arg);        }
     Unpacker& unpack(char*& arg, size_t sz) { return unpack_c_string(arg, sz);  }
 
+    //! Zero copy str, data points into the input buffer
+    Unpacker& unpack_view(const char*& data, size_t& length)
+    {
+        data = read_string(length);
+        return *this;
+    }
+
     template<typename T, std::size_t N>
     typename std::enable_if<sizeof(T) == 1, Unpacker&>::type 
     unpack(T (&arg)[N])                     { return unpack_binary(arg, N);     }
@@ -955,6 +1909,121 @@ public:
 
     template<typename K, typename V>
     Unpacker& unpack(std::map<K,V>& arg)        { return unpack_map(arg);       }
+
+    template<typename T, std::size_t N>
+    typename std::enable_if<sizeof(T) == 1, Unpacker&>::type
+    unpack(std::array<T, N>& arg)           { return unpack_binary(arg.data(), N);  }
+
+    template<typename T, std::size_t N>
+    typename std::enable_if<(sizeof(T) > 1), Unpacker&>::type
+    unpack(std::array<T, N>& arg)           { return unpack_array(arg.data(), N);   }
+
+    template<typename... Args>
+    Unpacker& unpack(std::tuple<Args...>& arg)
+    {
+        return unpack_tuple(arg, detail::make_index_sequence<sizeof...(Args)>());
+    }
+
+    template<typename T1, typename T2>
+    Unpacker& unpack(std::pair<T1, T2>& arg)
+    {
+        Nested nested(*this);
+        if(read_length(TYPE_ARRAY) != 2)
+            detail::fail<std::runtime_error>("Array size mismatch");
+
+        return unpack(arg.first).unpack(arg.second);
+    }
+
+#if __cplusplus >= 201703L
+    //! Only nil is empty, an empty string reads back engaged if it was sent as fixstr 0
+    template<typename T>
+    Unpacker& unpack(std::optional<T>& arg)
+    {
+        static_assert(!is_optional<T>::value, "An empty inner optional would read back as an empty outer one");
+
+        if(next_type() == TYPE_NIL) {
+            read_head();
+            arg.reset();
+            return *this;
+        }
+
+        if(!arg)
+            arg.emplace();
+
+        return unpack(*arg);
+    }
+
+    //! Alternatives must be default constructible
+    template<typename... Ts>
+    Unpacker& unpack(std::variant<Ts...>& arg)
+    {
+        Nested nested(*this);
+        if(read_length(TYPE_ARRAY) != 2)
+            detail::fail<std::runtime_error>("Array size mismatch");
+
+        size_t index;
+        unpack_integral(index);
+        return unpack_variant(arg, index, detail::make_index_sequence<sizeof...(Ts)>());
+    }
+#endif
+
+    //! Copies a typed array, converting it from the writer's byte order
+    template<typename T>
+    Unpacker& unpack_typed_array(std::vector<T>& ref)
+    {
+        size_t size;
+        bool swap;
+        const char* ptr = read_typed_array<T>(size, swap);
+
+        // the elements may be misaligned, copy bytes
+        charge<sizeof(T)>(size);
+        ref.resize(size);
+        if(size)
+            memcpy(ref.data(), ptr, size * sizeof(T));
+
+        if(swap) {
+            for(size_t i=0; i<size; i++) {
+                char* bytes = reinterpret_cast<char*>(&ref[i]);
+                std::reverse(bytes, bytes + sizeof(T));
+            }
+        }
+
+        return *this;
+    }
+
+    /*
+     * Zero copy typed array, data points into the input buffer. Throws
+     * if the elements are misaligned there or in foreign byte order,
+     * the vector overload handles both.
+     */
+    template<typename T>
+    Unpacker& unpack_typed_array(const T*& data, size_t& size)
+    {
+        bool swap;
+        const char* ptr = read_typed_array<T>(size, swap);
+
+        if(swap)
+            detail::fail<std::runtime_error>("Typed array byte order mismatch");
+
+        if(reinterpret_cast<uintptr_t>(ptr) % alignof(T))
+            detail::fail<std::runtime_error>("Typed array is misaligned");
+
+        data = reinterpret_cast<const T*>(ptr);
+        return *this;
+    }
+
+    //! Element count of the next array, at most the remaining input bytes
+    Unpacker& unpack_array_header(size_t& size)    { size = read_count(TYPE_ARRAY, 1); return *this; }
+
+    //! Header of an ext value, its length payload bytes follow
+    Unpacker& unpack_ext_header(int8_t& extType, size_t& length)
+    {
+        length = read_length(TYPE_EXT);
+        extType = read<int8_t>();
+        return *this;
+    }
+
+    Unpacker& unpack_map_header(size_t& size)      { size = read_count(TYPE_MAP, 2);   return *this; }
 };
 
 } // end namespace mpcompact
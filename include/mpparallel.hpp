@@ -0,0 +1,188 @@
+#pragma once
+
+#include "mpobject.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace mpcompact {
+
+/******************************************************
+ * Structural index of one large document
+ *
+ * A single pass records where every element of the
+ * containers at a chosen depth starts and ends, using
+ * Unpacker::skip() to step over their contents. Depth 1
+ * indexes the elements of the top level array (or the
+ * entries of a top level map, key and value together),
+ * depth 2 those of each of its elements or map values,
+ * and so on.
+ *
+ * MessagePack is length prefixed, so finding the next
+ * boundary means decoding the heads before it and the
+ * pass itself stays sequential. It only reads heads
+ * though, and the slices it yields decode in parallel.
+ ******************************************************/
+
+class StructuralIndex
+{
+    const char*         base;
+    size_t              length;
+    std::vector<size_t> starts;
+    std::vector<size_t> ends;
+
+    size_t position(const Unpacker& unpacker) const
+    {
+        return length - unpacker.size();
+    }
+
+    void index(Unpacker& unpacker, unsigned depth)
+    {
+        size_t elements;
+        size_t values = 1;
+        if(unpacker.next_type() == TYPE_MAP)
+        {
+            unpacker.unpack_map_header(elements);
+            values = 2;
+        }
+        else
+        {
+            unpacker.unpack_array_header(elements);
+        }
+
+        // every element takes at least one byte, bounds the reservation
+        if(elements > unpacker.size())
+            detail::fail<std::runtime_error>("No bytes remaining in buffer");
+
+        if(depth > 1)
+        {
+            // map keys are stepped over, their values hold the next level
+            for(size_t i=0; i<elements; i++) {
+                if(values == 2)
+                    unpacker.skip();
+
+                index(unpacker, depth - 1);
+            }
+
+            return;
+        }
+
+        starts.reserve(starts.size() + elements);
+        ends.reserve(ends.size() + elements);
+
+        for(size_t i=0; i<elements; i++)
+        {
+            starts.push_back(position(unpacker));
+            for(size_t v=0; v<values; v++)
+                unpacker.skip();
+            ends.push_back(position(unpacker));
+        }
+    }
+
+public:
+    //! Indexes the containers at depth in data, which must outlive the index
+    StructuralIndex(const char* data, size_t size, unsigned depth = 1)
+        : base(data), length(size), starts(), ends()
+    {
+        if(depth == 0)
+            detail::fail<std::invalid_argument>("Index depth must be at least 1");
+
+        Unpacker unpacker(data, size);
+        index(unpacker, depth);
+    }
+
+    //! Number of indexed elements
+    size_t size() const { return starts.size(); }
+
+    const char* data(size_t i) const        { return base + starts.at(i);           }
+    size_t      length_of(size_t i) const   { return ends.at(i) - starts.at(i);     }
+
+    //! Unpacker over element i only
+    Unpacker    element(size_t i) const     { return Unpacker(data(i), length_of(i)); }
+};
+
+
+/*****************************************************
+ * Parallel decode
+ *
+ * Splits the indexed elements into one contiguous
+ * range per thread. Each thread runs its own Unpacker
+ * per element, so options such as a dictionary must
+ * be set by fn and can not be incremental. The first
+ * exception thrown by any thread is rethrown once all
+ * of them have finished.
+ *****************************************************/
+
+//! Calls fn(i, unpacker) for every element of index, spread over threads
+template<typename F>
+void parallel_for(const StructuralIndex& index, F fn, unsigned threads = 0)
+{
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    const size_t size  = index.size();
+    const size_t chunk = (size + threads - 1) / threads;
+
+    std::exception_ptr error;
+    std::mutex         errorMutex;
+
+    auto run = [&](size_t begin, size_t end) {
+        try {
+            for(size_t i=begin; i<end; i++) {
+                Unpacker unpacker = index.element(i);
+                fn(i, unpacker);
+            }
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if(!error)
+                error = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for(size_t begin=chunk; begin<size; begin+=chunk)
+        workers.emplace_back(run, begin, std::min(size, begin + chunk));
+
+    // the calling thread takes the first range
+    run(0, std::min(size, chunk));
+
+    for(auto& worker : workers)
+        worker.join();
+
+    if(error)
+        std::rethrow_exception(error);
+}
+
+
+namespace detail {
+
+//! Objects are records, see Object::pack_record()
+template<typename T>
+typename std::enable_if<std::is_base_of<Object, T>::value>::type
+unpack_element(Unpacker& unpacker, T& ref)  { ref.unpack_record(unpacker); }
+
+template<typename T>
+typename std::enable_if<!std::is_base_of<Object, T>::value>::type
+unpack_element(Unpacker& unpacker, T& ref)  { unpacker.unpack(ref); }
+
+} // end namespace detail
+
+
+//! Replaces out with the decoded elements of index, T must be default constructible
+template<typename T>
+void parallel_unpack(const StructuralIndex& index, std::vector<T>& out, unsigned threads = 0)
+{
+    static_assert(!std::is_same<T, bool>::value, "std::vector<bool> elements can not be written concurrently");
+
+    // Objects are not movable, replace the vector instead of resizing it
+    if(out.size() != index.size())
+        std::vector<T>(index.size()).swap(out);
+
+    parallel_for(index, [&out](size_t i, Unpacker& unpacker) {
+        detail::unpack_element(unpacker, out[i]);
+    }, threads);
+}
+
+} // end namespace mpcompact
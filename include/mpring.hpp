@@ -0,0 +1,379 @@
+#pragma once
+
+#include "mppacker.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+namespace mpcompact {
+
+/******************************************************
+ * Lock-free ring buffer of packed messages
+ *
+ * Producers claim space by moving head forward with a
+ * CAS, so any number of them may share the ring, while
+ * one consumer reads in claim order and moves tail.
+ *
+ * Record:  uint64 header, payload, padding to 8 bytes
+ * Header:  slot size in the low 32 bits, the payload
+ *          length (or the owner until committed) in the
+ *          next 31, the top bit once committed
+ *
+ * A record never wraps. When it does not fit before the
+ * end of the ring the producer also claims the rest of
+ * it and fills that with a padding record. Abandoned
+ * records are padding too. The consumer zeroes every
+ * slot it releases, so stale bytes are never mistaken
+ * for a committed header.
+ ******************************************************/
+
+class RingBuffer
+{
+    RingBuffer(const RingBuffer&) = delete;
+    void operator=(const RingBuffer&) = delete;
+
+    struct Control
+    {
+        std::atomic<uint64_t> head;     //!< Claimed up to, by producers
+        char                  pad[64 - sizeof(std::atomic<uint64_t>)];
+        std::atomic<uint64_t> tail;     //!< Released up to, by the consumer
+        char                  pad2[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    static const size_t   HEADER    = sizeof(uint64_t);
+    static const uint32_t PADDING   = detail::MAX_31BIT;    //!< Length of skipped records
+    static const uint64_t COMMITTED = uint64_t(1) << 63;
+
+    std::vector<uint64_t>   memory;     //!< Owned storage, empty for external memory
+    Control*                control;
+    char*                   ring;
+    size_t                  capacity;
+    uint64_t                readSlot;   //!< Slot size of the record handed out by try_read()
+
+    static size_t align(size_t length)
+    {
+        return (length + HEADER - 1) & ~(HEADER - 1);
+    }
+
+    std::atomic<uint64_t>& header_at(uint64_t position)
+    {
+        return *reinterpret_cast<std::atomic<uint64_t>*>(ring + (position & (capacity - 1)));
+    }
+
+    static std::atomic<uint64_t>& header_of(char* data)
+    {
+        return *reinterpret_cast<std::atomic<uint64_t>*>(data - HEADER);
+    }
+
+    static uint64_t make_header(uint64_t slot, uint32_t length)
+    {
+        return COMMITTED | uint64_t(length) << 32 | slot;
+    }
+
+    static void publish(char* data, size_t length)
+    {
+        std::atomic<uint64_t>& header = header_of(data);
+        uint64_t reserved = header.load(std::memory_order_relaxed);
+        uint64_t slot = static_cast<uint32_t>(reserved);
+
+        // an oversized record is released as padding, the consumer would wait at it
+        bool fits = length == PADDING || HEADER + length <= slot;
+        if(!fits)
+            length = PADDING;
+
+        // fails once the consumer reclaimed the record, see reclaim()
+        if((reserved & COMMITTED) ||
+           !header.compare_exchange_strong(reserved, make_header(slot, length), std::memory_order_release))
+            detail::fail<std::runtime_error>("Record was reclaimed");
+
+        if(!fits)
+            detail::fail<std::runtime_error>("Record exceeds reserved length");
+    }
+
+    size_t slot_for(size_t length) const
+    {
+        if(length > max_length())
+            detail::fail<std::runtime_error>("Record exceeds ring capacity");
+
+        return align(HEADER + length);
+    }
+
+    //! Where a slot claimed at head starts and ends, false while it does not fit
+    bool place(uint64_t head, size_t slot, uint64_t& start, uint64_t& end) const
+    {
+        size_t offset = head & (capacity - 1);
+        start = capacity - offset < slot ? head + capacity - offset : head;
+        end = start + slot;
+
+        return end - control->tail.load(std::memory_order_acquire) <= capacity;
+    }
+
+    void attach(void* m, size_t size, bool create)
+    {
+        if(reinterpret_cast<uintptr_t>(m) % HEADER)
+            detail::fail<std::invalid_argument>("Ring memory must be 8 byte aligned");
+
+        if(size < sizeof(Control) + 2 * HEADER)
+            detail::fail<std::invalid_argument>("Ring memory too small");
+
+        // largest power of two that fits, slot sizes are stored in 32 bits
+        capacity = HEADER;
+        while(capacity * 2 <= size - sizeof(Control) && capacity * 2 <= detail::MAX_31BIT + size_t(1))
+            capacity *= 2;
+
+        control = static_cast<Control*>(m);
+        ring    = static_cast<char*>(m) + sizeof(Control);
+
+        if(create) {
+            memset(m, 0, sizeof(Control) + capacity);
+            new (&control->head) std::atomic<uint64_t>(0);
+            new (&control->tail) std::atomic<uint64_t>(0);
+        }
+    }
+
+public:
+    //! Bytes of memory needed for a ring of capacity bytes, a power of two
+    static size_t memory_size(size_t capacity) { return sizeof(Control) + capacity; }
+
+    //! Owns a ring of at least capacity bytes, rounded to a power of two
+    explicit RingBuffer(size_t capacity)
+        : memory(), control(NULL), ring(NULL), capacity(0), readSlot(0)
+    {
+        size_t size = HEADER;
+        while(size < capacity)
+            size *= 2;
+
+        memory.resize(memory_size(size) / sizeof(uint64_t));
+        attach(memory.data(), memory_size(size), true);
+    }
+
+    /*
+     * Ring in external memory, e.g. shared between processes. Exactly
+     * one side passes create to initialise it, the others attach.
+     */
+    RingBuffer(void* m, size_t size, bool create)
+        : memory(), control(NULL), ring(NULL), capacity(0), readSlot(0)
+    {
+        attach(m, size, create);
+    }
+
+    size_t size() const { return capacity; }
+
+    //! Largest payload a single record can hold
+    size_t max_length() const { return capacity / 2 - HEADER; }
+
+
+    /*
+     * Claims space for a payload of up to length bytes and returns where
+     * to write it, NULL while the ring is full. Pass the result to commit()
+     * or abandon(), records become readable in the order they were claimed.
+     */
+    char* try_reserve(size_t length)
+    {
+        const size_t slot = slot_for(length);
+
+        uint64_t head = control->head.load(std::memory_order_relaxed);
+        uint64_t start, end;
+        do {
+            if(!place(head, slot, start, end))
+                return NULL;
+
+        } while(!control->head.compare_exchange_weak(head, end, std::memory_order_relaxed));
+
+        if(start != head)
+            header_at(head).store(make_header(start - head, PADDING), std::memory_order_release);
+
+        // uncommitted, the consumer waits at this header until the top bit is set
+        header_at(start).store(slot, std::memory_order_relaxed);
+        return ring + (start & (capacity - 1)) + HEADER;
+    }
+
+    /*
+     * Claims like try_reserve(), for producers that serialise their claims
+     * through a lock of their own. The headers are written before the claim
+     * is published, so a producer that dies at any point leaves either no
+     * trace or a record owned by it, which the consumer can reclaim().
+     */
+    char* try_reserve_exclusive(size_t length, uint32_t owner)
+    {
+        const size_t slot = slot_for(length);
+
+        uint64_t head = control->head.load(std::memory_order_relaxed);
+        uint64_t start, end;
+        if(!place(head, slot, start, end))
+            return NULL;
+
+        header_at(start).store(uint64_t(owner & PADDING) << 32 | slot, std::memory_order_relaxed);
+        if(start != head)
+            header_at(head).store(make_header(start - head, PADDING), std::memory_order_relaxed);
+
+        control->head.store(end, std::memory_order_release);
+        return ring + (start & (capacity - 1)) + HEADER;
+    }
+
+    //! Publishes length bytes written at data, a longer record throws and is abandoned
+    void commit(char* data, size_t length)  { publish(data, length);    }
+
+    //! Releases a reservation without publishing it
+    void abandon(char* data)                { publish(data, PADDING);   }
+
+
+    /*
+     * Packs one message with fn(Packer&) straight into the ring. When it
+     * outgrows the length reserved for it, the reservation is abandoned
+     * and fn runs again on one twice as large. False while the ring is
+     * full.
+     */
+    template<typename F>
+    bool try_pack(size_t length, F fn)
+    {
+        return try_pack_with([this](size_t n) { return try_reserve(n); }, length, fn);
+    }
+
+    //! As try_pack(), claiming through reserve(length) instead of try_reserve()
+    template<typename R, typename F>
+    bool try_pack_with(R reserve, size_t length, F fn)
+    {
+        for(;;)
+        {
+            char* data = reserve(length);
+            if(data == NULL)
+                return false;
+
+            Packer packer(data, length);
+            try {
+                fn(packer);
+            } catch(...) {
+                // the record is dropped, so are the dictionary strings it defined
+                const bool overflow = packer.overflow();
+                packer.discard();
+                abandon(data);
+                if(!overflow || length == max_length())
+                    throw;
+
+                length = std::min(std::max(2 * length, size_t(HEADER)), max_length());
+                continue;
+            }
+
+            try {
+                commit(data, packer.size());
+            } catch(...) {
+                packer.discard();
+                throw;
+            }
+
+            return true;
+        }
+    }
+
+    //! Packs fixed shape values, reserving their max_packed_size
+    template<typename... Args>
+    bool try_pack_fixed(const Args&... args)
+    {
+        return try_pack(max_packed_size_of<Args...>::value, [&](Packer& packer) {
+            packer.pack_fixed(args...);
+        });
+    }
+
+
+    /*
+     * Next committed record in place, false if there is none yet. The
+     * record stays valid until release(), only the consumer calls this.
+     */
+    bool try_read(const char*& data, size_t& length)
+    {
+        return try_read_with(data, length, []() {});
+    }
+
+    //! As try_read(), calling released() after each padding record it frees
+    template<typename F>
+    bool try_read_with(const char*& data, size_t& length, F released)
+    {
+        for(;;)
+        {
+            // headers past head may be left over from an interrupted exclusive claim
+            uint64_t tail = control->tail.load(std::memory_order_relaxed);
+            if(tail == control->head.load(std::memory_order_acquire))
+                return false;
+
+            uint64_t header = header_at(tail).load(std::memory_order_acquire);
+            if((header & COMMITTED) == 0)
+                return false;
+
+            uint32_t size = (header >> 32) & PADDING;
+            readSlot = static_cast<uint32_t>(header);
+            if(size == PADDING) {
+                release();
+                released();
+                continue;
+            }
+
+            data = ring + (tail & (capacity - 1)) + HEADER;
+            length = size;
+            return true;
+        }
+    }
+
+    //! Owner of the claimed but uncommitted record the consumer waits for, 0 if none
+    uint32_t stalled_owner()
+    {
+        uint64_t tail = control->tail.load(std::memory_order_relaxed);
+        if(tail == control->head.load(std::memory_order_acquire))
+            return 0;
+
+        uint64_t header = header_at(tail).load(std::memory_order_acquire);
+        return (header & COMMITTED) ? 0 : (header >> 32) & PADDING;
+    }
+
+    /*
+     * Turns the uncommitted record of owner at the read position into
+     * padding, for owners known to be gone. A late commit() by the owner
+     * then throws instead of publishing.
+     */
+    bool reclaim(uint32_t owner)
+    {
+        uint64_t tail = control->tail.load(std::memory_order_relaxed);
+        if(tail == control->head.load(std::memory_order_acquire))
+            return false;
+
+        std::atomic<uint64_t>& header = header_at(tail);
+        uint64_t reserved = header.load(std::memory_order_acquire);
+        if((reserved & COMMITTED) || ((reserved >> 32) & PADDING) != owner)
+            return false;
+
+        return header.compare_exchange_strong(reserved, make_header(static_cast<uint32_t>(reserved), PADDING));
+    }
+
+    //! Frees the record returned by the last try_read()
+    void release()
+    {
+        uint64_t tail = control->tail.load(std::memory_order_relaxed);
+        memset(ring + (tail & (capacity - 1)), 0, readSlot);
+        control->tail.store(tail + readSlot, std::memory_order_release);
+        readSlot = 0;
+    }
+
+    //! Unpacks the next record into ref and releases it
+    template<typename T>
+    bool try_read(T& ref)
+    {
+        const char* data;
+        size_t length;
+        if(!try_read(data, length))
+            return false;
+
+        Unpacker unpacker(data, length);
+        try {
+            unpacker.unpack(ref);
+        } catch(...) {
+            release();
+            throw;
+        }
+
+        release();
+        return true;
+    }
+};
+
+} // end namespace mpcompact
@@ -0,0 +1,352 @@
+#pragma once
+
+#include "mpring.hpp"
+
+#include <chrono>
+#include <climits>
+#include <thread>
+
+#include <errno.h>
+#include <stdio.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace mpcompact {
+
+namespace detail {
+
+inline void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, unsigned micros)
+{
+    struct timespec timeout;
+    timeout.tv_sec  = micros / 1000000;
+    timeout.tv_nsec = (micros % 1000000) * 1000;
+
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t>& word, int count)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+//! True if pid has exited, including children that were not reaped yet
+inline bool process_gone(pid_t pid)
+{
+    if(kill(pid, 0) != 0)
+        return errno == ESRCH;
+
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+
+    FILE* f = fopen(path, "r");
+    if(f == NULL)
+        return false;
+
+    // state follows the parenthesised command name, which may contain spaces
+    char buffer[256];
+    size_t n = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    buffer[n] = 0;
+
+    const char* end = strrchr(buffer, ')');
+    return end && end[1] == ' ' && end[2] == 'Z';
+}
+
+} // end namespace detail
+
+
+/******************************************************
+ * Shared memory message channel
+ *
+ * A RingBuffer in a shared mapping, e.g. of a memfd
+ * passed over a Unix socket, with any number of
+ * producer processes and one consumer. Producers pack
+ * straight into the ring and the consumer reads records
+ * in place.
+ *
+ * Claims are serialised by a robust process-shared
+ * mutex and use RingBuffer::try_reserve_exclusive(),
+ * so a producer that dies while claiming leaves the
+ * ring consistent. Records it claimed but never
+ * committed carry its pid; the consumer reclaims them
+ * once the pid is gone.
+ *
+ * Waiting sides spin briefly, then sleep on a futex
+ * that the other side only wakes when someone waits:
+ * the consumer when the ring is empty, producers when
+ * it is full (backpressure).
+ ******************************************************/
+
+class SharedChannel
+{
+    SharedChannel(const SharedChannel&) = delete;
+    void operator=(const SharedChannel&) = delete;
+
+    struct Header
+    {
+        uint64_t                magic;
+        uint64_t                size;       //!< Bytes mapped, header included
+        pthread_mutex_t         claimMutex;
+
+        std::atomic<uint32_t>   dataSeq;    //!< Bumped on commit, consumer sleeps on it
+        std::atomic<uint32_t>   consumerWaiting;
+        std::atomic<uint32_t>   spaceSeq;   //!< Bumped on release, producers sleep on it
+        std::atomic<uint32_t>   producersWaiting;
+    };
+
+    static const uint64_t MAGIC     = 0x314e414843504d63ull;   //!< "cMPCHAN1"
+    static const size_t   RING      = (sizeof(Header) + 63) & ~size_t(63);
+    static const unsigned SPINS     = 1000;
+
+    Header*     header;
+    size_t      mapped;
+    RingBuffer* ring;
+    uint32_t    pid;
+    unsigned    recoveryMicros;
+
+    void map(int fd, size_t size)
+    {
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED)
+            throw std::runtime_error(std::string("Cannot map channel: ") + strerror(errno));
+
+        header = static_cast<Header*>(p);
+        mapped = size;
+    }
+
+    void lock()
+    {
+        int rc = pthread_mutex_lock(&header->claimMutex);
+
+        // the previous owner died, claims leave nothing to repair
+        if(rc == EOWNERDEAD)
+            rc = pthread_mutex_consistent(&header->claimMutex);
+
+        if(rc != 0)
+            throw std::runtime_error(std::string("Channel lock failed: ") + strerror(rc));
+    }
+
+    char* claim(size_t length)
+    {
+        lock();
+
+        char* data;
+        try {
+            data = ring->try_reserve_exclusive(length, pid);
+        } catch(...) {
+            pthread_mutex_unlock(&header->claimMutex);
+            throw;
+        }
+
+        pthread_mutex_unlock(&header->claimMutex);
+        return data;
+    }
+
+    //! Reclaims the record the consumer waits for if its producer is gone
+    void recover()
+    {
+        uint32_t owner = ring->stalled_owner();
+        if(owner && detail::process_gone(owner))
+            ring->reclaim(owner);
+    }
+
+    static void notify(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting, int count)
+    {
+        seq.fetch_add(1);
+        if(waiting.load())
+            detail::futex_wake(seq, count);
+    }
+
+    //! Wakes producers waiting for room, after any record is freed
+    void freed()
+    {
+        notify(header->spaceSeq, header->producersWaiting, INT_MAX);
+    }
+
+    //! Next record, freeing padding and reclaimed records on the way like release()
+    bool next(const char*& data, size_t& length)
+    {
+        return ring->try_read_with(data, length, [this]() { freed(); });
+    }
+
+public:
+    /*
+     * Creates a channel with a ring of capacity bytes in fd, a memfd or
+     * shm object the caller owns, resizing it. The consumer usually
+     * creates, producers attach with the other constructor.
+     */
+    SharedChannel(int fd, size_t capacity)
+        : header(NULL), mapped(0), ring(NULL), pid(getpid()), recoveryMicros(10000)
+    {
+        size_t size = RING + RingBuffer::memory_size(capacity);
+        if(ftruncate(fd, size) != 0)
+            throw std::runtime_error(std::string("Cannot size channel: ") + strerror(errno));
+
+        map(fd, size);
+
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->claimMutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        new (&header->dataSeq)          std::atomic<uint32_t>(0);
+        new (&header->consumerWaiting)  std::atomic<uint32_t>(0);
+        new (&header->spaceSeq)         std::atomic<uint32_t>(0);
+        new (&header->producersWaiting) std::atomic<uint32_t>(0);
+
+        ring = new RingBuffer(reinterpret_cast<char*>(header) + RING, size - RING, true);
+
+        header->size = size;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = MAGIC;
+    }
+
+    //! Attaches to a channel created in fd
+    explicit SharedChannel(int fd)
+        : header(NULL), mapped(0), ring(NULL), pid(getpid()), recoveryMicros(10000)
+    {
+        struct stat st;
+        if(fstat(fd, &st) != 0)
+            throw std::runtime_error(std::string("Cannot open channel: ") + strerror(errno));
+
+        if(static_cast<size_t>(st.st_size) < RING)
+            detail::fail<std::runtime_error>("Invalid channel");
+
+        map(fd, st.st_size);
+        if(header->magic != MAGIC || header->size != mapped) {
+            munmap(header, mapped);
+            detail::fail<std::runtime_error>("Invalid channel");
+        }
+
+        ring = new RingBuffer(reinterpret_cast<char*>(header) + RING, mapped - RING, false);
+    }
+
+    ~SharedChannel()
+    {
+        delete ring;
+        munmap(header, mapped);
+    }
+
+    //! How often a waiting consumer checks for records of dead producers
+    void recovery_interval(unsigned micros) { recoveryMicros = micros; }
+
+    size_t max_length() const { return ring->max_length(); }
+
+
+    //! Packs one message with fn(Packer&) into the channel, false while it is full
+    template<typename F>
+    bool try_pack(size_t length, F fn)
+    {
+        if(!ring->try_pack_with([this](size_t n) { return claim(n); }, length, fn))
+            return false;
+
+        notify(header->dataSeq, header->consumerWaiting, 1);
+        return true;
+    }
+
+    //! As try_pack(), waiting for the consumer to make room
+    template<typename F>
+    void pack(size_t length, F fn)
+    {
+        for(unsigned spins=0; !try_pack(length, fn); spins++)
+        {
+            if(spins < SPINS) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // retry after announcing the wait, a release in between bumps spaceSeq
+            header->producersWaiting.fetch_add(1);
+            uint32_t seq = header->spaceSeq.load();
+            bool done = try_pack(length, fn);
+            if(!done)
+                detail::futex_wait(header->spaceSeq, seq, recoveryMicros);
+
+            header->producersWaiting.fetch_sub(1);
+            if(done)
+                return;
+        }
+    }
+
+
+    //! Next record in place, false if there is none yet, consumer only
+    bool try_read(const char*& data, size_t& length)
+    {
+        return next(data, length);
+    }
+
+    /*
+     * Waits up to micros for the next record, reclaiming records of dead
+     * producers on the way. False on timeout.
+     */
+    bool read(const char*& data, size_t& length, unsigned micros)
+    {
+        typedef std::chrono::steady_clock clock;
+        const clock::time_point deadline = clock::now() + std::chrono::microseconds(micros);
+
+        for(unsigned spins=0; !next(data, length); spins++)
+        {
+            if(spins < SPINS)
+                continue;
+
+            clock::time_point now = clock::now();
+            if(now >= deadline)
+                return false;
+
+            recover();
+
+            unsigned left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+
+            // retry after announcing the wait, a commit in between bumps dataSeq
+            header->consumerWaiting.store(1);
+            uint32_t seq = header->dataSeq.load();
+            bool done = next(data, length);
+            if(!done)
+                detail::futex_wait(header->dataSeq, seq, std::min(left, recoveryMicros));
+
+            header->consumerWaiting.store(0);
+            if(done)
+                return true;
+        }
+
+        return true;
+    }
+
+    //! Frees the last record read, waking producers waiting for room
+    void release()
+    {
+        ring->release();
+        freed();
+    }
+
+    //! Waits for the next record, unpacks it into ref and releases it
+    template<typename T>
+    bool read(T& ref, unsigned micros)
+    {
+        const char* data;
+        size_t length;
+        if(!read(data, length, micros))
+            return false;
+
+        Unpacker unpacker(data, length);
+        try {
+            unpacker.unpack(ref);
+        } catch(...) {
+            release();
+            throw;
+        }
+
+        release();
+        return true;
+    }
+};
+
+} // end namespace mpcompact
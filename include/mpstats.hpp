@@ -0,0 +1,328 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sstream>
+#include <vector>
+
+/******************************************************
+ * Hot-path instrumentation
+ *
+ * Compiled out unless MPCOMPACT_STATS is defined. When
+ * enabled every thread keeps its own counters, so the
+ * hot hooks never synchronize. Each thread registers its
+ * counters on first use and folds them into a retired
+ * total when it exits; snapshot() sums all of them from
+ * any thread, thread_snapshot() returns the caller's.
+ ******************************************************/
+
+#ifdef MPCOMPACT_STATS
+#define MPCOMPACT_STAT(expr) ((void)(::mpcompact::stats::local().expr))
+#else
+#define MPCOMPACT_STAT(expr) ((void)0)
+#endif
+
+namespace mpcompact {
+
+namespace stats {
+
+//! Latency histogram, bucket i counts samples in [2^i, 2^(i+1)) ns
+struct Histogram
+{
+    static const size_t BUCKETS = 32;
+
+    uint64_t bucket[BUCKETS];
+    uint64_t count;
+    uint64_t total;
+
+    Histogram() : count(0), total(0) { memset(bucket, 0, sizeof(bucket)); }
+
+    void record(uint64_t ns)
+    {
+        size_t i = 0;
+        while(i < BUCKETS - 1 && (ns >> (i + 1)) != 0)
+            i++;
+
+        bucket[i]++;
+        count++;
+        total += ns;
+    }
+
+    Histogram& operator+=(const Histogram& other)
+    {
+        for(size_t i=0; i<BUCKETS; i++)
+            bucket[i] += other.bucket[i];
+
+        count += other.count;
+        total += other.total;
+        return *this;
+    }
+};
+
+
+//! Per Object type pack/unpack totals
+struct ObjectStats
+{
+    uint64_t    packBytes;
+    uint64_t    unpackBytes;
+    Histogram   packLatency;
+    Histogram   unpackLatency;
+
+    ObjectStats() : packBytes(0), unpackBytes(0), packLatency(), unpackLatency() {}
+
+    ObjectStats& operator+=(const ObjectStats& other)
+    {
+        packBytes += other.packBytes;
+        unpackBytes += other.unpackBytes;
+        packLatency += other.packLatency;
+        unpackLatency += other.unpackLatency;
+        return *this;
+    }
+};
+
+
+//! Written by its own thread only, read by snapshot() from any thread
+class Counter
+{
+    std::atomic<uint64_t> value;
+
+public:
+    Counter(uint64_t v = 0) : value(v) {}
+    Counter(const Counter& other) : value(uint64_t(other)) {}
+
+    Counter& operator=(const Counter& other)
+    {
+        value.store(uint64_t(other), std::memory_order_relaxed);
+        return *this;
+    }
+
+    operator uint64_t() const { return value.load(std::memory_order_relaxed); }
+
+    // a load and a store, no locked instruction, as there is a single writer
+    Counter& operator+=(uint64_t n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        return *this;
+    }
+
+    uint64_t operator++(int)
+    {
+        const uint64_t old = *this;
+        *this += 1;
+        return old;
+    }
+};
+
+
+struct Counters
+{
+    Counter tagsOut[256];   //!< Indexed by emitted header byte
+    Counter tagsIn[256];    //!< Indexed by consumed header byte
+    Counter bytesOut;
+    Counter bytesIn;
+    Counter bufferGrowths;  //!< PackerDynamic reallocations
+
+    std::map<std::string, uint64_t>     exceptions; //!< Keyed by what(), see count_exception()
+    std::map<std::string, ObjectStats>  objects;    //!< Keyed by typeid name, see record_pack()
+
+    Counters() : bytesOut(0), bytesIn(0), bufferGrowths(0), exceptions(), objects() {}
+
+    Counters& operator+=(const Counters& other)
+    {
+        for(size_t i=0; i<256; i++) {
+            tagsOut[i] += other.tagsOut[i];
+            tagsIn[i] += other.tagsIn[i];
+        }
+
+        bytesOut += other.bytesOut;
+        bytesIn += other.bytesIn;
+        bufferGrowths += other.bufferGrowths;
+
+        for(auto& kv : other.exceptions)
+            exceptions[kv.first] += kv.second;
+
+        for(auto& kv : other.objects)
+            objects[kv.first] += kv.second;
+
+        return *this;
+    }
+};
+
+
+namespace detail {
+
+struct ThreadCounters;
+
+//! Counters of the live threads and the sum of those that exited
+struct Registry
+{
+    std::mutex                      mutex;
+    std::vector<ThreadCounters*>    threads;
+    Counters                        retired;
+};
+
+inline Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+struct ThreadCounters
+{
+    Counters    counters;
+    std::mutex  mutex;      //!< Guards the maps, which snapshot() walks from other threads
+
+    ThreadCounters()
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.threads.push_back(this);
+    }
+
+    ~ThreadCounters()
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.retired += counters;
+        r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+    }
+};
+
+inline ThreadCounters& thread_counters()
+{
+    static thread_local ThreadCounters counters;
+    return counters;
+}
+
+} // end namespace detail
+
+
+//! Counters of the calling thread
+inline Counters& local() { return detail::thread_counters().counters; }
+
+//! Counters of the calling thread only
+inline Counters thread_snapshot() { return local(); }
+
+/* Sum over the exited threads and the live ones. Live counters
+ * are read while their threads run, so the total is only as
+ * recent as each counter was when it was read. */
+inline Counters snapshot()
+{
+    detail::Registry& r = detail::registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    Counters total = r.retired;
+    for(auto thread : r.threads) {
+        std::lock_guard<std::mutex> threadLock(thread->mutex);
+        total += thread->counters;
+    }
+    return total;
+}
+
+//! Zeroes the calling thread's counters
+inline void reset()
+{
+    detail::ThreadCounters& t = detail::thread_counters();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    t.counters = Counters();
+}
+
+inline void count_exception(const char* what)
+{
+    detail::ThreadCounters& t = detail::thread_counters();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    t.counters.exceptions[what]++;
+}
+
+inline void record_pack(const char* type, uint64_t bytes, uint64_t ns)
+{
+    detail::ThreadCounters& t = detail::thread_counters();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    ObjectStats& s = t.counters.objects[type];
+    s.packBytes += bytes;
+    s.packLatency.record(ns);
+}
+
+inline void record_unpack(const char* type, uint64_t bytes, uint64_t ns)
+{
+    detail::ThreadCounters& t = detail::thread_counters();
+    std::lock_guard<std::mutex> lock(t.mutex);
+    ObjectStats& s = t.counters.objects[type];
+    s.unpackBytes += bytes;
+    s.unpackLatency.record(ns);
+}
+
+
+class Timer
+{
+    std::chrono::steady_clock::time_point start;
+
+public:
+    Timer() : start(std::chrono::steady_clock::now()) {}
+
+    uint64_t elapsed() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+
+inline void format(const Histogram& h, const std::string& name, std::ostringstream& out)
+{
+    out << name << ".count " << h.count << "\n";
+    out << name << ".total_ns " << h.total << "\n";
+    for(size_t i=0; i<Histogram::BUCKETS; i++) {
+        if(h.bucket[i])
+            out << name << ".le_" << (uint64_t(2) << i) << "ns " << h.bucket[i] << "\n";
+    }
+}
+
+//! Exports counters as "name value" lines, zero counters are omitted
+inline std::string format(const Counters& c)
+{
+    std::ostringstream out;
+
+    out << "bytes_out " << c.bytesOut << "\n";
+    out << "bytes_in " << c.bytesIn << "\n";
+    out << "buffer_growths " << c.bufferGrowths << "\n";
+
+    char tag[8];
+    for(size_t i=0; i<256; i++) {
+        snprintf(tag, sizeof(tag), "0x%02zx", i);
+        if(c.tagsOut[i])
+            out << "tag_out." << tag << " " << c.tagsOut[i] << "\n";
+        if(c.tagsIn[i])
+            out << "tag_in." << tag << " " << c.tagsIn[i] << "\n";
+    }
+
+    for(auto& kv : c.exceptions) {
+        std::string what = kv.first;
+        for(auto& ch : what) {
+            if(ch == ' ')
+                ch = '_';
+        }
+        out << "exception." << what << " " << kv.second << "\n";
+    }
+
+    for(auto& kv : c.objects) {
+        const std::string name = "object." + kv.first;
+        out << name << ".pack_bytes " << kv.second.packBytes << "\n";
+        out << name << ".unpack_bytes " << kv.second.unpackBytes << "\n";
+        format(kv.second.packLatency, name + ".pack", out);
+        format(kv.second.unpackLatency, name + ".unpack", out);
+    }
+
+    return out.str();
+}
+
+} // end namespace stats
+
+} // end namespace mpcompact
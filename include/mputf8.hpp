@@ -0,0 +1,328 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// x86 kernels are compiled per function, see utf8_valid()
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MPCOMPACT_UTF8_SIMD
+#include <immintrin.h>
+#endif
+
+namespace mpcompact {
+
+namespace detail {
+
+/******************************************************
+ * UTF-8 validation
+ *
+ * The vector kernels check 16/32 bytes per step with
+ * the lookup algorithm of Keiser & Lemire, "Validating
+ * UTF-8 In Less Than One Instruction Per Byte": three
+ * nibble tables classify every byte pair, a saturating
+ * subtract marks the bytes that must be 3rd/4th bytes
+ * of a sequence. Blocks that are pure ASCII only check
+ * that no sequence was left open.
+ *
+ * On x86 with GCC or Clang the AVX2 or SSSE3 kernel is
+ * chosen by the CPU at run time, no -m flag needed.
+ * Elsewhere the scalar loop is used.
+ ******************************************************/
+
+inline bool utf8_valid_scalar(const uint8_t* p, size_t n)
+{
+    size_t i = 0;
+    while(i < n)
+    {
+        uint8_t c = p[i];
+        if(c < 0x80) {
+            i++;
+            continue;
+        }
+
+        size_t  length;
+        uint8_t low  = 0x80;
+        uint8_t high = 0xbf;
+        if(c >= 0xc2 && c <= 0xdf)
+        {
+            length = 2;
+        }
+        else if(c >= 0xe0 && c <= 0xef)
+        {
+            length = 3;
+            if(c == 0xe0) low = 0xa0;
+            if(c == 0xed) high = 0x9f;
+        }
+        else if(c >= 0xf0 && c <= 0xf4)
+        {
+            length = 4;
+            if(c == 0xf0) low = 0x90;
+            if(c == 0xf4) high = 0x8f;
+        }
+        else
+        {
+            return false;
+        }
+
+        if(n - i < length)
+            return false;
+
+        if(p[i+1] < low || p[i+1] > high)
+            return false;
+
+        for(size_t k=2; k<length; k++) {
+            if((p[i+k] & 0xc0) != 0x80)
+                return false;
+        }
+
+        i += length;
+    }
+
+    return true;
+}
+
+
+namespace utf8 {
+
+static const uint8_t TOO_SHORT   = 1 << 0;
+static const uint8_t TOO_LONG    = 1 << 1;
+static const uint8_t OVERLONG_3  = 1 << 2;
+static const uint8_t TOO_LARGE   = 1 << 3;
+static const uint8_t SURROGATE   = 1 << 4;
+static const uint8_t OVERLONG_2  = 1 << 5;
+static const uint8_t TOO_LARGE_1000 = 1 << 6;
+static const uint8_t OVERLONG_4  = 1 << 6;
+static const uint8_t TWO_CONTS   = 1 << 7;
+static const uint8_t CARRY       = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+//! Indexed by the high nibble of the first byte of a pair
+static const uint8_t BYTE_1_HIGH[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+//! Indexed by the low nibble of the first byte of a pair
+static const uint8_t BYTE_1_LOW[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+//! Indexed by the high nibble of the second byte of a pair
+static const uint8_t BYTE_2_HIGH[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+
+#ifdef MPCOMPACT_UTF8_SIMD
+
+#define MPCOMPACT_AVX2  __attribute__ (( target("avx2")  ))
+#define MPCOMPACT_SSSE3 __attribute__ (( target("ssse3") ))
+
+struct Avx2
+{
+    typedef __m256i type;
+    static const size_t SIZE = 32;
+
+    MPCOMPACT_AVX2 static type load(const uint8_t* p)  { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    MPCOMPACT_AVX2 static type zero()                  { return _mm256_setzero_si256(); }
+    MPCOMPACT_AVX2 static type splat(uint8_t v)        { return _mm256_set1_epi8(static_cast<char>(v)); }
+    MPCOMPACT_AVX2 static type table(const uint8_t* t) { return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(t))); }
+
+    MPCOMPACT_AVX2 static type lookup(type t, type idx)    { return _mm256_shuffle_epi8(t, idx); }
+    MPCOMPACT_AVX2 static type high_nibble(type v)         { return _mm256_and_si256(_mm256_srli_epi16(v, 4), splat(0x0f)); }
+    MPCOMPACT_AVX2 static type low_nibble(type v)          { return _mm256_and_si256(v, splat(0x0f)); }
+    MPCOMPACT_AVX2 static type and_(type a, type b)        { return _mm256_and_si256(a, b); }
+    MPCOMPACT_AVX2 static type or_(type a, type b)         { return _mm256_or_si256(a, b); }
+    MPCOMPACT_AVX2 static type xor_(type a, type b)        { return _mm256_xor_si256(a, b); }
+    MPCOMPACT_AVX2 static type subs(type a, type b)        { return _mm256_subs_epu8(a, b); }
+    MPCOMPACT_AVX2 static bool is_ascii(type v)            { return _mm256_movemask_epi8(v) == 0; }
+    MPCOMPACT_AVX2 static bool any(type v)                 { return !_mm256_testz_si256(v, v); }
+
+    //! Input shifted by N bytes, pulling in the tail of prev
+    template<int N>
+    MPCOMPACT_AVX2 static type prev(type input, type prev)
+    {
+        return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - N);
+    }
+
+    //! Non zero where the final bytes of v start a sequence that did not end
+    MPCOMPACT_AVX2 static type incomplete(type v)
+    {
+        static const uint8_t MAX[32] = {
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+        };
+        return subs(v, load(MAX));
+    }
+};
+
+struct Ssse3
+{
+    typedef __m128i type;
+    static const size_t SIZE = 16;
+
+    MPCOMPACT_SSSE3 static type load(const uint8_t* p)  { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    MPCOMPACT_SSSE3 static type zero()                  { return _mm_setzero_si128(); }
+    MPCOMPACT_SSSE3 static type splat(uint8_t v)        { return _mm_set1_epi8(static_cast<char>(v)); }
+    MPCOMPACT_SSSE3 static type table(const uint8_t* t) { return load(t); }
+
+    MPCOMPACT_SSSE3 static type lookup(type t, type idx)    { return _mm_shuffle_epi8(t, idx); }
+    MPCOMPACT_SSSE3 static type high_nibble(type v)         { return _mm_and_si128(_mm_srli_epi16(v, 4), splat(0x0f)); }
+    MPCOMPACT_SSSE3 static type low_nibble(type v)          { return _mm_and_si128(v, splat(0x0f)); }
+    MPCOMPACT_SSSE3 static type and_(type a, type b)        { return _mm_and_si128(a, b); }
+    MPCOMPACT_SSSE3 static type or_(type a, type b)         { return _mm_or_si128(a, b); }
+    MPCOMPACT_SSSE3 static type xor_(type a, type b)        { return _mm_xor_si128(a, b); }
+    MPCOMPACT_SSSE3 static type subs(type a, type b)        { return _mm_subs_epu8(a, b); }
+    MPCOMPACT_SSSE3 static bool is_ascii(type v)            { return _mm_movemask_epi8(v) == 0; }
+    MPCOMPACT_SSSE3 static bool any(type v)                 { return _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero())) != 0xffff; }
+
+    template<int N>
+    MPCOMPACT_SSSE3 static type prev(type input, type prev) { return _mm_alignr_epi8(input, prev, 16 - N); }
+
+    MPCOMPACT_SSSE3 static type incomplete(type v)
+    {
+        static const uint8_t MAX[16] = {
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+        };
+        return subs(v, load(MAX));
+    }
+};
+
+/*
+ * Always inlined into the kernel of its vector type, so vectors are never
+ * passed to a function compiled without that target, see -Wpsabi.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+template<typename V>
+__attribute__ (( always_inline )) inline bool valid(const uint8_t* p, size_t n)
+{
+    typedef typename V::type vec;
+
+    const vec byte1High = V::table(BYTE_1_HIGH);
+    const vec byte1Low  = V::table(BYTE_1_LOW);
+    const vec byte2High = V::table(BYTE_2_HIGH);
+
+    vec error           = V::zero();
+    vec prevInput       = V::zero();
+    vec prevIncomplete  = V::zero();
+
+    uint8_t tail[V::SIZE];
+    for(size_t i=0; i<n; i+=V::SIZE)
+    {
+        vec input;
+        if(n - i >= V::SIZE) {
+            input = V::load(p + i);
+        } else {
+            memset(tail, 0x20, sizeof(tail));
+            memcpy(tail, p + i, n - i);
+            input = V::load(tail);
+        }
+
+        if(V::is_ascii(input))
+        {
+            error = V::or_(error, prevIncomplete);
+        }
+        else
+        {
+            vec prev1 = V::template prev<1>(input, prevInput);
+            vec special = V::and_(V::and_(
+                            V::lookup(byte1High, V::high_nibble(prev1)),
+                            V::lookup(byte1Low, V::low_nibble(prev1))),
+                            V::lookup(byte2High, V::high_nibble(input)));
+
+            vec prev2 = V::template prev<2>(input, prevInput);
+            vec prev3 = V::template prev<3>(input, prevInput);
+            vec third  = V::subs(prev2, V::splat(0xe0 - 0x80));
+            vec fourth = V::subs(prev3, V::splat(0xf0 - 0x80));
+            vec must23 = V::and_(V::or_(third, fourth), V::splat(0x80));
+
+            error = V::or_(error, V::xor_(must23, special));
+            prevIncomplete = V::incomplete(input);
+        }
+
+        prevInput = input;
+    }
+
+    error = V::or_(error, prevIncomplete);
+    return !V::any(error);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+MPCOMPACT_AVX2  inline bool valid_avx2(const uint8_t* p, size_t n)  { return valid<Avx2>(p, n);  }
+MPCOMPACT_SSSE3 inline bool valid_ssse3(const uint8_t* p, size_t n) { return valid<Ssse3>(p, n); }
+
+#undef MPCOMPACT_AVX2
+#undef MPCOMPACT_SSSE3
+
+typedef bool (*Kernel)(const uint8_t*, size_t);
+
+//! Widest kernel the running CPU supports
+inline Kernel select_kernel()
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return valid_avx2;
+
+    if(__builtin_cpu_supports("ssse3"))
+        return valid_ssse3;
+
+    return utf8_valid_scalar;
+}
+
+#endif
+
+} // end namespace utf8
+
+
+inline bool utf8_valid(const char* data, size_t length)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+
+#if defined(__AVX2__)
+    return utf8::valid_avx2(p, length);
+#elif defined(MPCOMPACT_UTF8_SIMD)
+    static const utf8::Kernel kernel = utf8::select_kernel();
+    return kernel(p, length);
+#else
+    return utf8_valid_scalar(p, length);
+#endif
+}
+
+} // end namespace detail
+
+} // end namespace mpcompact
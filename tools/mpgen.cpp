@@ -0,0 +1,519 @@
+/******************************************************
+ * mpgen - generates codecs for message schemas
+ *
+ * Build:   g++ -std=c++11 -O2 -o mpgen tools/mpgen.cpp
+ * Run:     mpgen schema.mp [-n namespace] [-o out.hpp]
+ *
+ * Schema:
+ *
+ *   // comments run to the end of the line
+ *   message Quote {
+ *       double          bid;
+ *       double          ask;
+ *   }
+ *
+ *   message Trade {
+ *       int64           id;
+ *       string          symbol;
+ *       Quote           quote;          // earlier message, inlined
+ *       array<int32, 4> flags;          // std::array
+ *       list<double>    fills;          // std::vector
+ *       list<Quote>     history;
+ *       map<string, uint32> tags;       // std::map
+ *       bytes           raw;            // std::vector<uint8_t>
+ *   }
+ *
+ * Scalars: bool int8 int16 int32 int64 uint8 uint16
+ * uint32 uint64 float double.
+ *
+ * Every message becomes a struct and a pack()/unpack()
+ * pair of inline functions. Fields are packed in order
+ * with no header, so the bytes match an Object that
+ * reg()s the same fields. Nested messages are expanded
+ * into their fields. Elements of a list of messages are
+ * records, an array of their fields as written by
+ * Object::pack_record(). Each run of two or more fixed
+ * shape fields is packed with one Packer::pack_fixed()
+ * call, which checks the capacity once for the run.
+ ******************************************************/
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Type
+{
+    enum Kind { SCALAR, STRING, BYTES, MESSAGE, ARRAY, LIST, MAP } kind;
+
+    std::string         name;       //!< Scalar or message name
+    std::vector<Type>   args;       //!< Element, or key and value
+    size_t              size;       //!< Length of ARRAY
+
+    Type() : kind(SCALAR), name(), args(), size(0) {}
+};
+
+struct Field
+{
+    Type        type;
+    std::string name;
+};
+
+struct Message
+{
+    std::string         name;
+    std::vector<Field>  fields;
+};
+
+const std::map<std::string, std::string>& scalars()
+{
+    static const std::map<std::string, std::string> types = {
+        { "bool",   "bool"      },
+        { "int8",   "int8_t"    },
+        { "int16",  "int16_t"   },
+        { "int32",  "int32_t"   },
+        { "int64",  "int64_t"   },
+        { "uint8",  "uint8_t"   },
+        { "uint16", "uint16_t"  },
+        { "uint32", "uint32_t"  },
+        { "uint64", "uint64_t"  },
+        { "float",  "float"     },
+        { "double", "double"    },
+    };
+    return types;
+}
+
+
+/*****************************************************
+ * Parser
+ *****************************************************/
+
+class Parser
+{
+    std::string     file;
+    std::string     text;
+    size_t          pos;
+    size_t          line;
+
+    std::vector<Message>            messages;
+    std::map<std::string, size_t>   index;
+
+    [[noreturn]] void error(const std::string& what)
+    {
+        std::cerr << file << ":" << line << ": " << what << "\n";
+        exit(1);
+    }
+
+    void space()
+    {
+        while(pos < text.size())
+        {
+            if(text[pos] == '\n') {
+                line++;
+                pos++;
+            } else if(isspace(static_cast<unsigned char>(text[pos]))) {
+                pos++;
+            } else if(text.compare(pos, 2, "//") == 0) {
+                while(pos < text.size() && text[pos] != '\n')
+                    pos++;
+            } else {
+                break;
+            }
+        }
+    }
+
+    std::string word()
+    {
+        space();
+        size_t start = pos;
+        while(pos < text.size() && (isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_'))
+            pos++;
+
+        if(start == pos)
+            error("expected a name");
+
+        return text.substr(start, pos - start);
+    }
+
+    bool peek(char c)
+    {
+        space();
+        return pos < text.size() && text[pos] == c;
+    }
+
+    void expect(char c)
+    {
+        if(!peek(c))
+            error(std::string("expected '") + c + "'");
+
+        pos++;
+    }
+
+    //! depth counts the lists and maps around the type
+    Type type(unsigned depth = 0)
+    {
+        Type t;
+        t.name = word();
+
+        if(scalars().count(t.name))
+        {
+            t.kind = Type::SCALAR;
+        }
+        else if(t.name == "string")
+        {
+            t.kind = Type::STRING;
+        }
+        else if(t.name == "bytes")
+        {
+            t.kind = Type::BYTES;
+        }
+        else if(t.name == "array")
+        {
+            t.kind = Type::ARRAY;
+            expect('<');
+            t.args.push_back(type(depth + 1));
+            expect(',');
+
+            std::string n = word();
+            char* end;
+            t.size = strtoul(n.c_str(), &end, 10);
+            if(*end || t.size == 0)
+                error("array length must be a positive number");
+
+            expect('>');
+        }
+        else if(t.name == "list")
+        {
+            t.kind = Type::LIST;
+            expect('<');
+            t.args.push_back(type(depth + 1));
+            expect('>');
+        }
+        else if(t.name == "map")
+        {
+            t.kind = Type::MAP;
+            expect('<');
+            t.args.push_back(type(depth + 1));
+            expect(',');
+            t.args.push_back(type(depth + 1));
+            expect('>');
+
+            for(auto& arg : t.args) {
+                if(arg.kind == Type::MESSAGE)
+                    error("map keys and values can not be messages");
+            }
+        }
+        else if(index.count(t.name))
+        {
+            t.kind = Type::MESSAGE;
+            if(depth > 1)
+                error("messages can only be fields or list elements of a field");
+        }
+        else
+        {
+            error("unknown type '" + t.name + "', messages must be defined before use");
+        }
+
+        if(t.kind == Type::ARRAY && t.args[0].kind != Type::SCALAR)
+            error("array elements must be scalars");
+
+        return t;
+    }
+
+    void message()
+    {
+        Message m;
+        m.name = word();
+        if(index.count(m.name) || scalars().count(m.name))
+            error("'" + m.name + "' is already defined");
+
+        std::set<std::string> names;
+        expect('{');
+        while(!peek('}'))
+        {
+            Field f;
+            f.type = type();
+            f.name = word();
+            expect(';');
+
+            if(!names.insert(f.name).second)
+                error("duplicate field '" + f.name + "'");
+
+            m.fields.push_back(f);
+        }
+        expect('}');
+
+        if(m.fields.empty())
+            error("message '" + m.name + "' has no fields");
+
+        index[m.name] = messages.size();
+        messages.push_back(m);
+    }
+
+public:
+    Parser(const std::string& f, const std::string& t) : file(f), text(t), pos(0), line(1) {}
+
+    std::vector<Message> parse()
+    {
+        for(space(); pos < text.size(); space())
+        {
+            if(word() != "message")
+                error("expected 'message'");
+
+            message();
+        }
+
+        return messages;
+    }
+};
+
+
+/*****************************************************
+ * Code generation
+ *****************************************************/
+
+class Generator
+{
+    const std::vector<Message>&     messages;
+    std::map<std::string, size_t>   index;
+    std::ostringstream              out;
+
+    //! A field reached from the message being packed, nested messages expanded
+    struct Leaf
+    {
+        Type        type;
+        std::string path;
+    };
+
+    std::string cpp(const Type& t) const
+    {
+        switch(t.kind)
+        {
+            case Type::SCALAR:  return scalars().at(t.name);
+            case Type::STRING:  return "std::string";
+            case Type::BYTES:   return "std::vector<uint8_t>";
+            case Type::MESSAGE: return t.name;
+            case Type::ARRAY:   return "std::array<" + cpp(t.args[0]) + ", " + std::to_string(t.size) + ">";
+            case Type::LIST:    return "std::vector<" + cpp(t.args[0]) + ">";
+            case Type::MAP:     return "std::map<" + cpp(t.args[0]) + ", " + cpp(t.args[1]) + ">";
+        }
+
+        return "";
+    }
+
+    //! Fixed shape fields have a max_packed_size
+    static bool fixed(const Type& t)
+    {
+        return t.kind == Type::SCALAR || t.kind == Type::ARRAY;
+    }
+
+    size_t field_count(const std::string& message) const
+    {
+        std::vector<Leaf> all;
+        leaves(messages[index.at(message)], "", all);
+        return all.size();
+    }
+
+    void leaves(const Message& m, const std::string& prefix, std::vector<Leaf>& out) const
+    {
+        for(auto& f : m.fields)
+        {
+            if(f.type.kind == Type::MESSAGE) {
+                leaves(messages[index.at(f.type.name)], prefix + f.name + ".", out);
+                continue;
+            }
+
+            Leaf leaf = { f.type, prefix + f.name };
+            out.push_back(leaf);
+        }
+    }
+
+    void pack_leaf(const Leaf& leaf)
+    {
+        if(leaf.type.kind == Type::LIST && leaf.type.args[0].kind == Type::MESSAGE)
+        {
+            // every element is a record, so the array holds size values
+            out << "    packer.pack_array_header(m." << leaf.path << ".size());\n"
+                << "    for(auto& e : m." << leaf.path << ") {\n"
+                << "        packer.pack_array_header(" << field_count(leaf.type.args[0].name) << ");\n"
+                << "        pack(packer, e);\n"
+                << "    }\n";
+        }
+        else
+        {
+            out << "    packer.pack(m." << leaf.path << ");\n";
+        }
+    }
+
+    void unpack_leaf(const Leaf& leaf)
+    {
+        if(leaf.type.kind == Type::LIST && leaf.type.args[0].kind == Type::MESSAGE)
+        {
+            out << "    {\n"
+                << "        size_t size, fields;\n"
+                << "        unpacker.unpack_array_header(size);\n"
+                << "        unpacker.charge<sizeof(" << leaf.type.args[0].name << ")>(size);\n"
+                << "        m." << leaf.path << ".resize(size);\n"
+                << "        for(auto& e : m." << leaf.path << ") {\n"
+                << "            unpacker.unpack_array_header(fields);\n"
+                << "            if(fields != " << field_count(leaf.type.args[0].name) << ")\n"
+                << "                mpcompact::detail::fail<std::runtime_error>(\"Field count mismatch\");\n"
+                << "            unpack(unpacker, e);\n"
+                << "        }\n"
+                << "    }\n";
+        }
+        else
+        {
+            out << "    unpacker.unpack(m." << leaf.path << ");\n";
+        }
+    }
+
+    void generate(const Message& m)
+    {
+        std::vector<Leaf> all;
+        leaves(m, "", all);
+
+        bool shape = true;
+        for(auto& leaf : all)
+            shape = shape && fixed(leaf.type);
+
+        out << "struct " << m.name << "\n{\n";
+        for(auto& f : m.fields)
+            out << "    " << cpp(f.type) << " " << f.name << ";\n";
+
+        if(shape)
+        {
+            // an enumerator needs no out of class definition when ODR-used
+            out << "\n    //! Largest encoding, see Packer::pack_fixed()\n"
+                << "    enum : size_t { MAX_PACKED_SIZE = mpcompact::max_packed_size_of<";
+            for(size_t i=0; i<all.size(); i++)
+                out << (i ? ", " : "") << cpp(all[i].type);
+            out << ">::value };\n";
+        }
+        out << "};\n\n";
+
+        out << "inline void pack(mpcompact::Packer& packer, const " << m.name << "& m)\n{\n";
+        for(size_t i=0; i<all.size(); )
+        {
+            size_t end = i;
+            while(end < all.size() && fixed(all[end].type))
+                end++;
+
+            if(end - i < 2) {
+                pack_leaf(all[i++]);
+                continue;
+            }
+
+            // one capacity check for the run
+            out << "    packer.pack_fixed(";
+            for(size_t first=i; i<end; i++)
+                out << (i == first ? "" : ", ") << "m." << all[i].path;
+            out << ");\n";
+        }
+        out << "}\n\n";
+
+        out << "inline void unpack(mpcompact::Unpacker& unpacker, " << m.name << "& m)\n{\n";
+        for(auto& leaf : all)
+            unpack_leaf(leaf);
+        out << "}\n\n";
+    }
+
+public:
+    explicit Generator(const std::vector<Message>& m) : messages(m), index(), out()
+    {
+        for(size_t i=0; i<messages.size(); i++)
+            index[messages[i].name] = i;
+    }
+
+    std::string run(const std::string& source, const std::string& ns)
+    {
+        out << "// Generated by mpgen from " << source << ", do not edit\n"
+            << "#pragma once\n\n"
+            << "#include \"mppacker.hpp\"\n\n"
+            << "#include <array>\n"
+            << "#include <map>\n"
+            << "#include <string>\n"
+            << "#include <vector>\n\n";
+
+        if(!ns.empty())
+            out << "namespace " << ns << " {\n\n";
+
+        for(auto& m : messages)
+            generate(m);
+
+        if(!ns.empty())
+            out << "} // end namespace " << ns << "\n";
+
+        return out.str();
+    }
+};
+
+
+int usage()
+{
+    std::cerr << "usage: mpgen schema.mp [-n namespace] [-o out.hpp]\n";
+    return 2;
+}
+
+} // end anonymous namespace
+
+
+int main(int argc, char** argv)
+{
+    std::string input, output, ns;
+    for(int i=1; i<argc; i++)
+    {
+        std::string arg = argv[i];
+        if(arg == "-o" || arg == "-n")
+        {
+            if(i + 1 == argc)
+                return usage();
+
+            (arg == "-o" ? output : ns) = argv[++i];
+        }
+        else if(arg[0] == '-' || !input.empty())
+        {
+            return usage();
+        }
+        else
+        {
+            input = arg;
+        }
+    }
+
+    if(input.empty())
+        return usage();
+
+    std::ifstream in(input.c_str());
+    if(!in) {
+        std::cerr << "mpgen: cannot read " << input << "\n";
+        return 1;
+    }
+
+    std::stringstream text;
+    text << in.rdbuf();
+
+    std::vector<Message> messages = Parser(input, text.str()).parse();
+    std::string code = Generator(messages).run(input, ns);
+
+    if(output.empty()) {
+        std::cout << code;
+        return 0;
+    }
+
+    std::ofstream file(output.c_str());
+    file << code;
+    if(!file) {
+        std::cerr << "mpgen: cannot write " << output << "\n";
+        return 1;
+    }
+
+    return 0;
+}